@@ -0,0 +1,68 @@
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+#include "analog.h"
+
+#if ANALOG_ENABLED
+
+#define sbi(port, bit) (port |= (1 << bit))
+#define cbi(port, bit) (port &= ~(1 << bit))
+
+#if ANALOG_OVERSAMPLE & (ANALOG_OVERSAMPLE - 1) || ANALOG_OVERSAMPLE > 64
+#error "ANALOG_OVERSAMPLE must be a power of two and at most 64"
+#endif
+
+volatile uint16_t analog_value = 0;  // Filtered fader position
+volatile uint8_t analog_changed = 0; // Set when analog_value moved
+
+void analogInit(void) {
+  ADMUX  = (1 << REFS0) | ANALOG_CHANNEL;          // AVcc reference
+  ADCSRB = 0;                                      // Free running
+  ADCSRA = (1 << ADEN) | (1 << ADATE) | (1 << ADIE)
+         | (1 << ADPS2) | (1 << ADPS1) | (1 << ADPS0); // F_CPU / 128
+  sbi(ADCSRA, ADSC);
+}
+
+/*
+ * Runs at about 9.6 kHz. Sums ANALOG_OVERSAMPLE conversions, scales the sum
+ * back to 10 bits and only publishes a value that left the dead band
+ * around the last published one. The ends of the range always pass.
+ */
+ISR(ADC_vect, ISR_NOBLOCK) {
+  static uint16_t sum;
+  static uint8_t count;
+
+  cbi(ADCSRA, ADIE);
+
+  sum += ADC;
+  if (++count == ANALOG_OVERSAMPLE) {
+    uint16_t value = sum / ANALOG_OVERSAMPLE;
+    uint16_t last = analog_value;
+
+    sum = 0;
+    count = 0;
+
+    if (value != last && (value > last + ANALOG_HYSTERESIS || value + ANALOG_HYSTERESIS < last
+                          || value == 0 || value == ANALOG_MAX)) {
+      analog_value = value;
+      analog_changed = 1;
+    }
+  }
+
+  cli();
+  sbi(ADCSRA, ADIE);
+}
+
+uint8_t analogTake(uint16_t *value) {
+  uint8_t changed;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    changed = analog_changed;
+    *value = analog_value;
+    analog_changed = 0;
+  }
+
+  return changed;
+}
+
+#endif // ANALOG_ENABLED
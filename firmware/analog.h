@@ -0,0 +1,28 @@
+#ifndef __ANALOG_H__
+#define __ANALOG_H__
+
+#include <avr/io.h>
+#include <stdint.h>
+
+/*
+ * Linear fader on ADC6. The board has none, build with "make ANALOG=1"
+ * if one is connected, otherwise the open input sends noise as volume.
+ */
+#ifndef ANALOG_ENABLED
+#define ANALOG_ENABLED  0
+#endif
+#define ANALOG_CHANNEL  6
+
+/*
+ * Oversampling (must be a power of two) and the dead band in LSB of the
+ * decimated 10 bit value
+ */
+#define ANALOG_OVERSAMPLE  16
+#define ANALOG_HYSTERESIS  2
+
+#define ANALOG_MAX  1023
+
+void analogInit(void);
+uint8_t analogTake(uint16_t *value);
+
+#endif // __ANALOG_H__
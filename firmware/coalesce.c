@@ -0,0 +1,72 @@
+#include "coalesce.h"
+
+int16_t coalesce_steps[COALESCE_PAIRS]; // Net steps, positive is CW
+uint8_t coalesce_next = 0;              // Round robin start for coalesceNext()
+
+uint16_t coalesce_cancelled = 0; // Steps that cancelled out, each saved a step's reports
+
+void coalesceAdd(uint8_t pair, int8_t steps) {
+  int16_t pending = coalesce_steps[pair];
+
+  // Counted in the smaller of both magnitudes, saturating
+  if ((pending > 0 && steps < 0) || (pending < 0 && steps > 0)) {
+    uint16_t n = (steps < 0) ? -steps : steps;
+    uint16_t p = (pending < 0) ? -pending : pending;
+
+    n = (p < n) ? p : n;
+    coalesce_cancelled = (coalesce_cancelled > UINT16_MAX - n) ? UINT16_MAX : coalesce_cancelled + n;
+  }
+
+  // Clamped so the next add cannot overflow
+  pending += steps;
+  if (pending > INT16_MAX - 128) {
+    pending = INT16_MAX - 128;
+  } else if (pending < INT16_MIN + 128) {
+    pending = INT16_MIN + 128;
+  }
+
+  coalesce_steps[pair] = pending;
+}
+
+// Next pair with steps waiting, or COALESCE_NONE. Pairs take turns so one
+// busy knob cannot starve the others.
+uint8_t coalesceNext(void) {
+  uint8_t i;
+  uint8_t pair = coalesce_next;
+
+  for (i = 0; i < COALESCE_PAIRS; i++) {
+    if (++pair >= COALESCE_PAIRS) {
+      pair = 0;
+    }
+
+    if (coalesce_steps[pair]) {
+      coalesce_next = pair;
+      return pair;
+    }
+  }
+
+  return COALESCE_NONE;
+}
+
+// Removes up to max steps of the pair and returns them signed
+int16_t coalesceTake(uint8_t pair, int16_t max) {
+  int16_t steps = coalesce_steps[pair];
+
+  if (steps > max) {
+    steps = max;
+  } else if (steps < -max) {
+    steps = -max;
+  }
+
+  coalesce_steps[pair] -= steps;
+  return steps;
+}
+
+// Drops the steps of the pair beyond max
+void coalesceLimit(uint8_t pair, int16_t max) {
+  if (coalesce_steps[pair] > max) {
+    coalesce_steps[pair] = max;
+  } else if (coalesce_steps[pair] < -max) {
+    coalesce_steps[pair] = -max;
+  }
+}
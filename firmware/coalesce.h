@@ -0,0 +1,31 @@
+#ifndef __COALESCE_H__
+#define __COALESCE_H__
+
+#include <stdint.h>
+
+#include "settings.h"
+
+/*
+ * Rotation waiting to be sent, kept as a net step count per CW/CCW action
+ * pair. Steps in opposite directions cancel out before they cost reports.
+ * Pairs are the knob actions followed by the layer knob actions.
+ */
+#define COALESCE_PAIRS          (SETTINGS_KNOBS << 1)
+#define COALESCE_PAIR(knob, layer)  ((layer) ? SETTINGS_KNOBS + (knob) : (knob))
+#define COALESCE_NONE           0xFF
+
+/*
+ * Most steps a key action keeps waiting. Each one costs a press and a
+ * release report, so more would keep the host busy long after the knob
+ * stopped. Relative actions keep the exact count.
+ */
+#define COALESCE_KEY_BACKLOG    8
+
+extern uint16_t coalesce_cancelled;
+
+void    coalesceAdd(uint8_t pair, int8_t steps);
+uint8_t coalesceNext(void);
+int16_t coalesceTake(uint8_t pair, int16_t max);
+void    coalesceLimit(uint8_t pair, int16_t max);
+
+#endif // __COALESCE_H__
@@ -1,23 +1,74 @@
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
 #include "encoder.h"
+#include "event.h"
+#include "timer.h"
 
 #define PHASE_A (ENC_PIN & 1 << ENC_PIN_A)
 #define PHASE_B (ENC_PIN & 1 << ENC_PIN_B)
 
+#if ENC_KNOBS < 1 || ENC_KNOBS > 4
+#error "ENC_KNOBS must be between 1 and 4"
+#endif
+
+#if ENC_STEPS_PER_DETENT != 1 && ENC_STEPS_PER_DETENT != 2 && ENC_STEPS_PER_DETENT != 4
+#error "ENC_STEPS_PER_DETENT must be 1, 2 or 4"
+#endif
+
 #define sbi(port, bit) (port |= (1 << bit))
 #define cbi(port, bit) (port &= ~(1 << bit))
 
-uint8_t enc_buffer = 0; // Buffer for readings
+/*
+ * Every knob owns one bit pair of the sample byte, phase A in bit 2k and
+ * phase B in bit 2k + 1. All per-knob results are kept at the A positions.
+ */
+#define KNOB_BITS  (0x55 & ((1 << (ENC_KNOBS << 1)) - 1))
 
-void encInit(void) {
-  ENC_DDR &= ~((1 << ENC_PIN_A) | (1 << ENC_PIN_B) | (1 << ENC_BTN));
-  ENC_PORT |= (1 << ENC_PIN_A) | (1 << ENC_PIN_B) | (1 << ENC_BTN);
-}
+#if ENC_KNOBS > 1
+#define PCIE_BITS  ((1 << ENC_PCIE) | (1 << ENC_KNOB_PCIE))
+#else
+#define PCIE_BITS  (1 << ENC_PCIE)
+#endif
+
+/*
+ * Acceleration curves. Each point maps the time since the previous detent
+ * (in ms, upper bound) to the number of logical steps the detent is worth.
+ * Points are ordered by interval, the first match wins and anything
+ * slower than the last point is a single step.
+ */
+typedef struct {
+  uint8_t interval;
+  uint8_t steps;
+} enc_accel_point_t;
+
+const enc_accel_point_t enc_accel_curves[ENC_ACCEL_CURVES][ENC_ACCEL_POINTS] PROGMEM = {
+  // ENC_ACCEL_OFF
+  { {  0, 1 }, {  0, 1 }, {  0, 1 }, {  0, 1 } },
+  // ENC_ACCEL_GENTLE
+  { { 15, 3 }, { 30, 2 }, {  0, 1 }, {  0, 1 } },
+  // ENC_ACCEL_MEDIUM
+  { { 10, 6 }, { 20, 4 }, { 40, 2 }, {  0, 1 } },
+  // ENC_ACCEL_STRONG
+  { {  8, 10 }, { 16, 6 }, { 32, 3 }, { 60, 2 } },
+};
 
+uint8_t enc_accel = ENC_ACCEL_OFF; // Selected acceleration curve
 
-void encPoll(void) {
-  static uint8_t enc_state;
-  uint8_t tmp;  
-  uint8_t cur_state = 0;
+volatile uint16_t enc_glitches = 0; // Transitions where both phases changed at once
+volatile uint16_t enc_filtered = 0; // Spikes removed by the sampling filter
+volatile uint16_t enc_bounces = 0;  // Button bounces swallowed by the debounce
+
+uint8_t enc_debounce = ENC_DEBOUNCE_MS; // Button debounce window in ms
+
+uint8_t enc_state = 0;  // Last decoded sample
+uint8_t enc_pos[4];     // Bit planes of a vertical 4-bit counter, position within the detent
+#if ENC_SAMPLE_TIMER
+uint8_t enc_samples[2]; // The two raw samples before the current one
+#endif
+
+static uint8_t _encReadPhases(void) {
+  uint8_t cur_state = (ENC_KNOB_PIN & ENC_KNOB_MASK) << 2;
 
   if (PHASE_A) {
     sbi(cur_state, 0);
@@ -26,30 +77,213 @@ void encPoll(void) {
     sbi(cur_state, 1);
   }
 
-  tmp = enc_state;
-  if (cur_state == (tmp & 0x03)) {
+  return cur_state;
+}
+
+void encInit(void) {
+  ENC_DDR &= ~((1 << ENC_PIN_A) | (1 << ENC_PIN_B) | (1 << ENC_BTN));
+  ENC_PORT |= (1 << ENC_PIN_A) | (1 << ENC_PIN_B) | (1 << ENC_BTN);
+  ENC_KNOB_DDR &= ~ENC_KNOB_MASK;
+  ENC_KNOB_PORT |= ENC_KNOB_MASK;
+
+  // Start from the resting position, not from a made up transition
+  enc_state = _encReadPhases();
+#if ENC_SAMPLE_TIMER
+  enc_samples[0] = enc_samples[1] = enc_state;
+#else
+  // Every edge on one of the phases triggers the decoder
+  sbi(ENC_PCMSK, ENC_PCINT_A);
+  sbi(ENC_PCMSK, ENC_PCINT_B);
+  ENC_KNOB_PCMSK |= ENC_KNOB_MASK;
+  PCICR |= PCIE_BITS;
+#endif
+}
+
+static void _encCount(volatile uint16_t *counter, uint8_t bits) {
+  for (; bits; bits &= bits - 1) {
+    if (*counter < UINT16_MAX) {
+      (*counter)++;
+    }
+  }
+}
+
+static uint8_t _encAccel(uint8_t knob, uint8_t dir) {
+  static uint8_t last_dir[ENC_KNOBS];
+  static uint16_t last_time[ENC_KNOBS];
+  uint16_t now = timerNow();
+  uint16_t interval = now - last_time[knob];
+  uint8_t same_dir = (dir == last_dir[knob]);
+
+  last_dir[knob] = dir;
+  last_time[knob] = now;
+
+  // Reversing always starts slow, so a wiggle never jumps
+  if (!same_dir || interval > UINT8_MAX) {
+    return 1;
+  }
+
+  const enc_accel_point_t *point = enc_accel_curves[enc_accel];
+  uint8_t i;
+  for (i = 0; i < ENC_ACCEL_POINTS; i++, point++) {
+    if (interval <= pgm_read_byte(&point->interval)) {
+      return pgm_read_byte(&point->steps);
+    }
+  }
+
+  return 1;
+}
+
+// Knobs whose position counter equals value, a handful of byte operations
+// that the compiler folds for a constant value
+static inline uint8_t _encPosEquals(int8_t value) {
+  uint8_t eq = KNOB_BITS;
+  uint8_t i;
+
+  for (i = 0; i < 4; i++) {
+    eq &= (value & (1 << i)) ? enc_pos[i] : ~enc_pos[i];
+  }
+
+  return eq;
+}
+
+/*
+ * Decodes all knobs at once. This is the transition table done with bit
+ * operations: a knob steps when exactly one of its phases changed, and
+ * the direction is the previous A xor the current B (set for CW).
+ */
+static void _encUpdate(uint8_t cur_state) {
+  uint8_t changed = enc_state ^ cur_state;
+  uint8_t dir = (enc_state ^ (cur_state >> 1)) & KNOB_BITS;
+  uint8_t da = changed & KNOB_BITS;
+  uint8_t db = (changed >> 1) & KNOB_BITS;
+  uint8_t step = da ^ db;
+
+  enc_state = cur_state;
+
+  if (da & db) {
+    _encCount(&enc_glitches, da & db);
+  }
+
+  if (!step) {
     return;
   }
 
-  tmp = (tmp << 2) | cur_state;
-  enc_state = tmp;
+  // Count up for CW and down for CCW on all knobs in parallel
+  uint8_t carry = step & dir;
+  uint8_t borrow = step & ~dir;
+  uint8_t i, plane;
+  for (i = 0; i < 4; i++) {
+    plane = enc_pos[i];
+    enc_pos[i] = plane ^ carry ^ borrow;
+    carry &= plane;
+    borrow &= ~plane;
+  }
+
+  uint8_t cw = _encPosEquals(ENC_STEPS_PER_DETENT);
+  uint8_t ccw = _encPosEquals(-ENC_STEPS_PER_DETENT);
+
+  if (!(cw | ccw)) {
+    return;
+  }
+
+  for (i = 0; i < 4; i++) {
+    enc_pos[i] &= ~(cw | ccw);
+  }
+
+  // Only knobs that completed a detent get here
+  uint8_t knob, bit;
+  for (knob = 0, bit = 0x01; knob < ENC_KNOBS; knob++, bit <<= 2) {
+    if (cw & bit) {
+      eventPush(EVENT_STEP_CW, knob, _encAccel(knob, EVENT_STEP_CW));
+    } else if (ccw & bit) {
+      eventPush(EVENT_STEP_CCW, knob, _encAccel(knob, EVENT_STEP_CCW));
+    }
+  }
+}
+
+/*
+ * Button debounce, called once per millisecond. An integrator counts up
+ * while the switch reads pressed and down while it reads released, and
+ * the debounced state only flips once it hits either end. A level change
+ * that reverses the integrator before that is a suppressed bounce.
+ */
+void encButtonSample(void) {
+  static uint8_t btn_state;
+  static uint8_t btn_raw;
+  static uint8_t btn_count;
+  uint8_t raw = encGetButtonState();
+
+  if (raw != btn_raw) {
+    btn_raw = raw;
+    if (btn_count != 0 && btn_count != enc_debounce) {
+      _encCount(&enc_bounces, 0x01);
+    }
+  }
+
+  if (raw && btn_count < enc_debounce) {
+    btn_count++;
+  } else if (!raw && btn_count > 0) {
+    btn_count--;
+  }
 
-  if (tmp == 0xE1) {
-    enc_buffer = SPIN_CCW;
+  if (!btn_state && btn_count >= enc_debounce) {
+    btn_state = 1;
+    btn_count = enc_debounce; // in case the window was shortened meanwhile
+    eventPush(EVENT_BTN_DOWN, 0, 0);
+  } else if (btn_state && btn_count == 0) {
+    btn_state = 0;
+    eventPush(EVENT_BTN_UP, 0, 0);
   }
-  if (tmp == 0xD2) {
-    enc_buffer = SPIN_CW;
+}
+
+#if ENC_SAMPLE_TIMER
+void encSample(void) {
+  uint8_t s0 = _encReadPhases();
+  uint8_t s1 = enc_samples[0];
+  uint8_t s2 = enc_samples[1];
+
+  // A sample that disagrees with both neighbours is a single-sample spike
+  _encCount(&enc_filtered, (s1 ^ s0) & (s1 ^ s2));
+
+  // Bitwise 2-of-3 majority vote over the last three samples per phase
+  _encUpdate((s0 & s1) | (s1 & s2) | (s0 & s2));
+
+  enc_samples[1] = s1;
+  enc_samples[0] = s0;
+}
+#else
+// V-USB needs INT0 to be serviced within a few cycles, so this handler
+// enables interrupts right away and only masks the other event producers
+// while decoding. Both pin change groups share the handler.
+ISR(ENC_PCINT_vect, ISR_NOBLOCK) {
+  EVENT_CAPTURE_BEGIN();
+  _encUpdate(_encReadPhases());
+  EVENT_CAPTURE_END();
+}
+
+#if ENC_KNOBS > 1
+ISR(ENC_KNOB_PCINT_vect, ISR_ALIASOF(ENC_PCINT_vect));
+#endif
+#endif
+
+void encSetAccel(uint8_t curve) {
+  if (curve >= ENC_ACCEL_CURVES) {
+    curve = ENC_ACCEL_OFF;
   }
+
+  enc_accel = curve;
 }
 
-uint8_t encGetState(void) {
-  uint8_t tmp = enc_buffer;
-  enc_buffer = 0;
-  return tmp;
+void encSetDebounce(uint16_t ms) {
+  if (ms == 0) {
+    ms = 1;
+  } else if (ms > UINT8_MAX) {
+    ms = UINT8_MAX;
+  }
+
+  enc_debounce = ms;
 }
 
 uint8_t encGetButtonState(void) {
   return (ENC_PIN & (1 << ENC_BTN)) ? 0 : 1;
 }
-
-
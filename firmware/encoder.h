@@ -4,8 +4,17 @@
 #include <avr/io.h>
 #include <stdint.h>
 
+#include "timer.h"
+
+/*
+ * Number of knobs (1 to 4)
+ */
+#define ENC_KNOBS 4
+
 /*
  * Ports and Pins
+ * Knob 0 and the button sit on port B, knobs 1 to 3 on port C with
+ * phase A on the even and phase B on the odd pin (PC0/PC1, PC2/PC3, ...)
  */
 #define ENC_PIN_A PB4
 #define ENC_PIN_B PB3
@@ -15,16 +24,61 @@
 #define ENC_DDR   DDRB
 #define ENC_PORT  PORTB
 
+#define ENC_KNOB_PIN   PINC
+#define ENC_KNOB_DDR   DDRC
+#define ENC_KNOB_PORT  PORTC
+#define ENC_KNOB_MASK  ((1 << ((ENC_KNOBS - 1) << 1)) - 1)
+
+/*
+ * Pin change interrupts of the phases
+ */
+#define ENC_PCINT_A     PCINT4
+#define ENC_PCINT_B     PCINT3
+#define ENC_PCMSK       PCMSK0
+#define ENC_PCIE        PCIE0
+#define ENC_PCINT_vect  PCINT0_vect
+
+#define ENC_KNOB_PCMSK       PCMSK1
+#define ENC_KNOB_PCIE        PCIE1
+#define ENC_KNOB_PCINT_vect  PCINT1_vect
+
+/*
+ * Sampling mode: 0 decodes on every pin change, 1 samples the pins from
+ * the timer tick at ENC_SAMPLE_HZ and filters out single-sample spikes
+ */
+#define ENC_SAMPLE_TIMER  0
+#define ENC_SAMPLE_HZ     TIMER_TICK_HZ
+
+/*
+ * Quadrature transitions per mechanical detent (1, 2 or 4)
+ */
+#define ENC_STEPS_PER_DETENT  4
+
 /*
- * Spin direction
+ * Default button debounce window in ms
  */
-#define SPIN_CW   0x01 
-#define SPIN_CCW  0x10
+#define ENC_DEBOUNCE_MS  5
+
+/*
+ * Acceleration curves, see enc_accel_curves in encoder.c
+ */
+#define ENC_ACCEL_OFF     0x00
+#define ENC_ACCEL_GENTLE  0x01
+#define ENC_ACCEL_MEDIUM  0x02
+#define ENC_ACCEL_STRONG  0x03
+
+#define ENC_ACCEL_CURVES  4
+#define ENC_ACCEL_POINTS  4
+
+extern volatile uint16_t enc_glitches;
+extern volatile uint16_t enc_filtered;
+extern volatile uint16_t enc_bounces;
 
 void encInit(void);
-void encPoll(void);
-uint8_t encGetState(void);
+void encSample(void);
+void encButtonSample(void);
+void encSetAccel(uint8_t curve);
+void encSetDebounce(uint16_t ms);
 uint8_t encGetButtonState(void);
 
 #endif // __ENCODER_H__
-
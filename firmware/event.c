@@ -0,0 +1,65 @@
+#include "event.h"
+#include "timer.h"
+
+#if EVENT_QUEUE_SIZE & (EVENT_QUEUE_SIZE - 1) || EVENT_QUEUE_SIZE > 128
+#error "EVENT_QUEUE_SIZE must be a power of two and at most 128"
+#endif
+
+#define EVENT_MASK (EVENT_QUEUE_SIZE - 1)
+
+/*
+ * Single producer / single consumer ring. The capture interrupts are the
+ * only writers of event_head, the main loop the only writer of event_tail.
+ * Both indices run freely and are masked on access, so no locking is
+ * needed as long as the index stores are atomic (they are single bytes).
+ */
+volatile event_t events[EVENT_QUEUE_SIZE];
+volatile uint8_t event_head = 0;
+volatile uint8_t event_tail = 0;
+
+volatile uint8_t event_overflows = 0;  // Events dropped because the ring was full
+volatile uint8_t event_high_water = 0; // Highest fill level seen so far
+
+uint8_t eventPush(uint8_t type, uint8_t index, uint8_t arg) {
+  uint8_t head = event_head;
+  uint8_t fill = head - event_tail;
+
+  if (fill >= EVENT_QUEUE_SIZE) {
+    if (event_overflows < UINT8_MAX) {
+      event_overflows++;
+    }
+    return 0;
+  }
+
+  volatile event_t *ev = &events[head & EVENT_MASK];
+  ev->type  = type;
+  ev->index = index;
+  ev->arg   = arg;
+  ev->time  = timerNow();
+
+  fill++;
+  if (fill > event_high_water) {
+    event_high_water = fill;
+  }
+
+  // Publish only after the slot is complete
+  event_head = head + 1;
+  return 1;
+}
+
+uint8_t eventPop(event_t *ev) {
+  uint8_t tail = event_tail;
+
+  if (tail == event_head) {
+    return 0;
+  }
+
+  volatile event_t *slot = &events[tail & EVENT_MASK];
+  ev->type  = slot->type;
+  ev->index = slot->index;
+  ev->arg   = slot->arg;
+  ev->time  = slot->time;
+
+  event_tail = tail + 1;
+  return 1;
+}
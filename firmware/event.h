@@ -0,0 +1,51 @@
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <stdint.h>
+
+/*
+ * Size of the input event ring, must be a power of two
+ */
+#define EVENT_QUEUE_SIZE  32
+
+/*
+ * Event types
+ */
+#define EVENT_STEP_CW   0x01
+#define EVENT_STEP_CCW  0x02
+#define EVENT_BTN_DOWN  0x03
+#define EVENT_BTN_UP    0x04
+#define EVENT_KEY_DOWN  0x05
+#define EVENT_KEY_UP    0x06
+
+/*
+ * Every producer runs as an ISR_NOBLOCK handler, so it can be interrupted
+ * by the USB interrupt. To keep the ring single-producer the producers
+ * (pin change and timer interrupts) mask each other between these two.
+ */
+#define EVENT_CAPTURE_BEGIN()                               \
+  uint8_t _event_pcicr = PCICR, _event_timsk0 = TIMSK0;     \
+  PCICR = 0;                                                \
+  TIMSK0 = 0
+
+#define EVENT_CAPTURE_END()                                 \
+  cli();                                                    \
+  PCICR = _event_pcicr;                                     \
+  TIMSK0 = _event_timsk0
+
+typedef struct {
+  uint8_t  type;
+  uint8_t  index; // Knob number for EVENT_STEP_*, key number for EVENT_KEY_*
+  uint8_t  arg;   // Logical steps for EVENT_STEP_*
+  uint16_t time;  // timerNow() when the event was captured
+} event_t;
+
+extern volatile uint8_t event_overflows;
+extern volatile uint8_t event_high_water;
+
+uint8_t eventPush(uint8_t type, uint8_t index, uint8_t arg);
+uint8_t eventPop(event_t *ev);
+
+#endif // __EVENT_H__
@@ -0,0 +1,117 @@
+#include "gesture.h"
+
+/*
+ * Button gesture recognizer. It is fed with the timestamped button edges
+ * from the event ring and polled with the current time for the gestures
+ * that are recognized by a timeout. Nothing in here ever waits.
+ */
+
+#define STATE_IDLE      0x00
+#define STATE_PRESSED   0x01 // First press, might become a long press
+#define STATE_RELEASED  0x02 // Waiting whether a second tap follows
+#define STATE_SECOND    0x03 // Second press of a double tap
+#define STATE_LONG      0x04 // Long press fired, repeating hold until release
+#define STATE_CANCELLED 0x05 // Press was used otherwise, ignored until release
+
+uint8_t gesture_state = STATE_IDLE;
+uint16_t gesture_time = 0; // Time of the last edge or hold repeat
+
+// A modifier without a key is an action as well
+static uint8_t _gestureIsSet(uint8_t reg) {
+  return settingsGetKeycode(reg) != 0 || settingsGetModifiers(reg) != 0;
+}
+
+static uint16_t _gestureHoldTime(void) {
+  uint16_t ms = settingsGetTime(SETTINGS_TIME_HOLD);
+  return (ms < SETTINGS_TIME_MIN) ? SETTINGS_TIME_MIN : ms;
+}
+
+static uint8_t _gestureElapsed(uint16_t now, uint8_t which) {
+  return (uint16_t)(now - gesture_time) >= settingsGetTime(which);
+}
+
+// The timeouts are decided by the edge times as well, gesturePoll() may not
+// have run in between (e.g. while the reports did not fit)
+uint8_t gestureButton(uint8_t pressed, uint16_t time) {
+  uint8_t state = gesture_state;
+  uint8_t timeout;
+
+  timeout = (state == STATE_RELEASED) ? SETTINGS_TIME_DTAP : SETTINGS_TIME_LONG;
+  timeout = _gestureElapsed(time, timeout);
+  gesture_time = time;
+
+  if (pressed) {
+    gesture_state = STATE_PRESSED;
+
+    if (state == STATE_RELEASED) {
+      // Too late for a double tap, the first one was a single tap
+      if (timeout) {
+        return GESTURE_TAP;
+      }
+
+      gesture_state = STATE_SECOND;
+      return GESTURE_DTAP;
+    }
+
+    return GESTURE_NONE;
+  }
+
+  gesture_state = STATE_IDLE;
+
+  if (state != STATE_PRESSED) {
+    return GESTURE_NONE;
+  }
+
+  // Held past the long press time without gesturePoll() noticing
+  if (timeout && (_gestureIsSet(GESTURE_LONG) || _gestureIsSet(GESTURE_HOLD))) {
+    return _gestureIsSet(GESTURE_LONG) ? GESTURE_LONG : GESTURE_NONE;
+  }
+
+  // Without a double tap action there is nothing to wait for
+  if (_gestureIsSet(GESTURE_DTAP)) {
+    gesture_state = STATE_RELEASED;
+    return GESTURE_NONE;
+  }
+
+  return GESTURE_TAP;
+}
+
+uint8_t gesturePoll(uint16_t now) {
+  switch (gesture_state) {
+    case STATE_PRESSED:
+      if (!_gestureIsSet(GESTURE_LONG) && !_gestureIsSet(GESTURE_HOLD)) {
+        break;
+      }
+
+      if (_gestureElapsed(now, SETTINGS_TIME_LONG)) {
+        gesture_state = STATE_LONG;
+        gesture_time = now;
+        return _gestureIsSet(GESTURE_LONG) ? GESTURE_LONG : GESTURE_NONE;
+      }
+      break;
+
+    case STATE_RELEASED:
+      if (_gestureElapsed(now, SETTINGS_TIME_DTAP)) {
+        gesture_state = STATE_IDLE;
+        return GESTURE_TAP;
+      }
+      break;
+
+    case STATE_LONG:
+      if (_gestureIsSet(GESTURE_HOLD) && (uint16_t)(now - gesture_time) >= _gestureHoldTime()) {
+        gesture_time += _gestureHoldTime();
+        return GESTURE_HOLD;
+      }
+      break;
+  }
+
+  return GESTURE_NONE;
+}
+
+// The press is part of something else (e.g. rotating a layer), so it must
+// not turn into a gesture when it ends
+void gestureCancel(void) {
+  if (gesture_state != STATE_IDLE && gesture_state != STATE_RELEASED) {
+    gesture_state = STATE_CANCELLED;
+  }
+}
@@ -0,0 +1,21 @@
+#ifndef __GESTURE_H__
+#define __GESTURE_H__
+
+#include <stdint.h>
+
+#include "settings.h"
+
+/*
+ * Gestures are reported as the action slot they trigger
+ */
+#define GESTURE_NONE    0x00
+#define GESTURE_TAP     SETTINGS_BTN
+#define GESTURE_DTAP    SETTINGS_DTAP
+#define GESTURE_LONG    SETTINGS_LONG
+#define GESTURE_HOLD    SETTINGS_HOLD
+
+uint8_t gestureButton(uint8_t pressed, uint16_t time);
+uint8_t gesturePoll(uint16_t now);
+void    gestureCancel(void);
+
+#endif // __GESTURE_H__
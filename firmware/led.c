@@ -0,0 +1,57 @@
+#include "led.h"
+
+#define sbi(port, bit) (port |= (1 << bit))
+#define cbi(port, bit) (port &= ~(1 << bit))
+
+volatile uint8_t led_remaining = 0; // Milliseconds until the pulse ends
+volatile uint8_t led_level = 0;     // Between pulses
+volatile uint8_t led_pattern = 0;   // Bit 0 is shown first, 0 for none
+uint8_t led_step = LED_PULSE_MS;    // Milliseconds per pattern bit
+uint8_t led_count = LED_PULSE_MS;   // Milliseconds left of the current bit
+uint8_t led_bit = 0;
+
+void ledInit(void) {
+  sbi(LED_DDR, LED_PIN);
+  cbi(LED_PORT, LED_PIN);
+}
+
+// A pulse while the LED is lit just extends it
+void ledPulse(void) {
+  led_remaining = LED_PULSE_MS;
+  sbi(LED_PORT, LED_PIN);
+}
+
+void ledSet(uint8_t on) {
+  led_level = on ? 1 : 0;
+}
+
+// Repeats the pattern from bit 0, step 0 keeps the current step
+void ledPattern(uint8_t pattern, uint8_t step_ms) {
+  led_pattern = 0;
+  if (step_ms) {
+    led_step = step_ms;
+  }
+  led_count = led_step;
+  led_bit = 0;
+  led_pattern = pattern;
+}
+
+// Called from the timer interrupt once per millisecond
+void ledTick(void) {
+  if (led_remaining) {
+    led_remaining--;
+  }
+
+  if (led_pattern && !--led_count) {
+    led_count = led_step;
+    led_bit = (led_bit + 1) & 0x07;
+  }
+
+  uint8_t lit = led_pattern ? (led_pattern >> led_bit) & 0x01 : led_level ^ (led_remaining != 0);
+
+  if (lit) {
+    sbi(LED_PORT, LED_PIN);
+  } else {
+    cbi(LED_PORT, LED_PIN);
+  }
+}
@@ -0,0 +1,24 @@
+#ifndef __LED_H__
+#define __LED_H__
+
+#include <avr/io.h>
+#include <stdint.h>
+
+/*
+ * Activity LED on PB0. A pulse is switched off again from the timer tick,
+ * so signalling a report never waits. The level set by ledSet() is shown
+ * with pulses inverting it, a pattern set by the host is shown one bit per
+ * step instead of both.
+ */
+#define LED_DDR       DDRB
+#define LED_PORT      PORTB
+#define LED_PIN       PB0
+#define LED_PULSE_MS  10
+
+void ledInit(void);
+void ledPulse(void);
+void ledSet(uint8_t on);
+void ledPattern(uint8_t pattern, uint8_t step_ms);
+void ledTick(void);
+
+#endif // __LED_H__
@@ -1,15 +1,45 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <avr/wdt.h>
-#include <util/delay.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "usbdrv.h"
+#include "analog.h"
+#include "coalesce.h"
 #include "encoder.h"
+#include "event.h"
+#include "gesture.h"
+#include "led.h"
+#include "matrix.h"
+#include "repeat.h"
 #include "settings.h"
+#include "timer.h"
 #include "usb.h"
 
+#if ENC_KNOBS > SETTINGS_KNOBS
+#error "Not enough action slots for ENC_KNOBS"
+#endif
+
+#if MATRIX_KEYS > SETTINGS_KEYS
+#error "Not enough action slots for MATRIX_KEYS"
+#endif
+
+// Most reports one action can queue, a press and a release
+#define ACTION_REPORTS 2
+
+// Matrix keys held down as keyboard keys, with the modifiers and keycode
+// they were pressed with, so their release does not depend on the settings
+uint8_t held_keys[MATRIX_KEYS];
+uint8_t held_modifiers[MATRIX_KEYS];
+uint8_t held_keycodes[MATRIX_KEYS];
+
+// Sends the held keys plus the given key, keycode 0 sends only the held
+// keys. The report has 5 key slots, further keys are left out.
 void send_keyboard_key(uint8_t modifiers, uint8_t keycode) {
+    uint8_t slot = 3;
+    uint8_t i;
+
     report_buffer[0] = REPID_KEYBOARD;
     report_buffer[1] = modifiers;
     report_buffer[2] = 0; // reserved
@@ -18,7 +48,22 @@ void send_keyboard_key(uint8_t modifiers, uint8_t keycode) {
     report_buffer[5] = 0;
     report_buffer[6] = 0;
     report_buffer[7] = 0;
-    
+
+    if (keycode) {
+        slot++;
+    }
+
+    for (i = 0; i < MATRIX_KEYS; i++) {
+        if (!held_keys[i]) {
+            continue;
+        }
+
+        report_buffer[1] |= held_modifiers[i];
+        if (held_keycodes[i] && slot < REPSIZE_KEYBOARD && !memchr(report_buffer + 3, held_keycodes[i], slot - 3)) {
+            report_buffer[slot++] = held_keycodes[i];
+        }
+    }
+
     usbReportSend(REPSIZE_KEYBOARD);
 }
 
@@ -35,6 +80,62 @@ void send_mm_key(uint8_t key) {
     usbReportSend(REPSIZE_MMKEY);
 }
 
+void send_fader(uint16_t value) {
+    report_buffer[0] = REPID_FADER;
+    report_buffer[1] = value & 0xFF;
+    report_buffer[2] = value >> 8;
+    usbReportSend(REPSIZE_FADER);
+}
+
+void send_volume(int8_t change) {
+    report_buffer[0] = REPID_VOLUME;
+    report_buffer[1] = change;
+    usbReportSend(REPSIZE_VOLUME);
+}
+
+uint8_t dial_button = 0;
+
+void send_dial(int16_t change) {
+    uint16_t value = ((uint16_t)change << 1) | dial_button;
+
+    report_buffer[0] = REPID_DIAL;
+    report_buffer[1] = value & 0xFF;
+    report_buffer[2] = value >> 8;
+    usbReportSend(REPSIZE_DIAL);
+}
+
+int8_t wheel_rest = 0; // Low resolution remainders in high resolution units
+int8_t pan_rest = 0;
+
+// Wheel changes are in high resolution units, they are scaled down for as
+// long as the host has not enabled the resolution multiplier
+int16_t mouse_scale(int16_t change, uint8_t hires, int8_t *rest) {
+    if (hires) {
+        return change;
+    }
+
+    change += *rest;
+    *rest = change % MOUSE_RES_MULTIPLIER;
+    return change / MOUSE_RES_MULTIPLIER;
+}
+
+void send_wheel(int16_t wheel, int16_t pan) {
+    wheel = mouse_scale(wheel, mouse_resolution & MOUSE_RES_WHEEL, &wheel_rest);
+    pan = mouse_scale(pan, mouse_resolution & MOUSE_RES_PAN, &pan_rest);
+
+    if (wheel == 0 && pan == 0) {
+        return;
+    }
+
+    report_buffer[0] = REPID_MOUSE;
+    report_buffer[1] = 0; // buttons
+    report_buffer[2] = 0; // X
+    report_buffer[3] = 0; // Y
+    report_buffer[4] = wheel;
+    report_buffer[5] = pan;
+    usbReportSend(REPSIZE_MOUSE);
+}
+
 void send(uint8_t type, uint8_t modifiers, uint8_t keycode) {
     switch (type) {
         case TYPE_KEYBOARD:
@@ -44,77 +145,332 @@ void send(uint8_t type, uint8_t modifiers, uint8_t keycode) {
         case TYPE_MM:
             send_mm_key(keycode);
             break;
+
+        case TYPE_VOLUME:
+            send_volume(keycode);
+            break;
+
+        case TYPE_DIAL:
+            send_dial((int8_t)keycode);
+            break;
+
+        case TYPE_WHEEL:
+            send_wheel((int8_t)keycode, 0);
+            break;
+
+        case TYPE_PAN:
+            send_wheel(0, (int8_t)keycode);
+            break;
     }
 }
 
-int main() {
-    uchar i;
+void send_press(uint8_t reg) {
+    send(settingsGetType(reg), settingsGetModifiers(reg), settingsGetKeycode(reg));
+}
+
+void send_release(uint8_t reg) {
+    uint8_t type = settingsGetType(reg);
 
-    // PB0 as output for LED
-    DDRB = 1 << PB0;
+    // Multimedia keys are released by send_mm_key() already
+    if (type == TYPE_KEYBOARD) {
+        send(type, 0x00, 0x00);
+    }
+}
+
+void send_step(uint8_t reg) {
+    send_press(reg);
+    send_release(reg);
+}
+
+// Keyboard actions of matrix keys stay pressed until the key is released,
+// other types are sent as a tap
+void press_key(uint8_t key) {
+    uint8_t reg = SETTINGS_KEY(key);
+
+    if (settingsGetType(reg) != TYPE_KEYBOARD) {
+        send_press(reg);
+        return;
+    }
+
+    held_keys[key] = 1;
+    held_modifiers[key] = settingsGetModifiers(reg);
+    held_keycodes[key] = settingsGetKeycode(reg);
+    send_keyboard_key(0x00, 0x00);
+}
+
+void release_key(uint8_t key) {
+    if (held_keys[key]) {
+        held_keys[key] = 0;
+        send_keyboard_key(0x00, 0x00);
+    }
+}
+
+// Report ID that carries an action of the type
+uint8_t type_report(uint8_t type) {
+    switch (type) {
+        case TYPE_KEYBOARD:
+            return REPID_KEYBOARD;
+
+        case TYPE_VOLUME:
+            return REPID_VOLUME;
+
+        case TYPE_DIAL:
+            return REPID_DIAL;
+
+        case TYPE_WHEEL:
+        case TYPE_PAN:
+            return REPID_MOUSE;
+    }
 
+    return REPID_MMKEY;
+}
+
+// The reports of the action fit into the queue of their endpoint
+uint8_t action_fits(uint8_t reg) {
+    return usbReportFree(type_report(settingsGetType(reg))) >= ACTION_REPORTS;
+}
+
+// The reports an event can cause fit, rotation only goes into the counts
+uint8_t event_fits(event_t *ev) {
+    switch (ev->type) {
+        case EVENT_BTN_DOWN:
+        case EVENT_BTN_UP:
+            return action_fits(SETTINGS_BTN) && action_fits(SETTINGS_DTAP) && action_fits(SETTINGS_LONG);
+
+        case EVENT_KEY_DOWN:
+            return action_fits(SETTINGS_KEY(ev->index));
+
+        case EVENT_KEY_UP:
+            return usbReportFree(REPID_KEYBOARD) >= ACTION_REPORTS;
+    }
+
+    return 1;
+}
+
+uint8_t pair_reg(uint8_t pair, uint8_t cw) {
+    if (pair < SETTINGS_KNOBS) {
+        return cw ? SETTINGS_KNOB_CW(pair) : SETTINGS_KNOB_CCW(pair);
+    }
+
+    pair -= SETTINGS_KNOBS;
+    return cw ? SETTINGS_LAYER_KNOB_CW(pair) : SETTINGS_LAYER_KNOB_CCW(pair);
+}
+
+// Adds as many further steps of the pair as fit into limit and returns
+// the total change, steps already holds the first one
+int16_t take_change(uint8_t pair, int16_t steps, int8_t change, int16_t limit) {
+    int16_t n = limit / ((change < 0) ? -change : change);
+
+    if (n > 1) {
+        steps += coalesceTake(pair, n - 1);
+    }
+
+    return ((steps < 0) ? -steps : steps) * change;
+}
+
+// Sends pending rotation of an action pair. Key actions go one step at a
+// time with a bounded backlog, relative actions take as many steps as fit
+// into one report.
+void send_pair(uint8_t pair) {
+    int16_t steps = coalesceTake(pair, 1);
+    uint8_t reg = pair_reg(pair, steps > 0);
+    int8_t change = settingsGetKeycode(reg);
+
+    switch (settingsGetType(reg)) {
+        case TYPE_VOLUME:
+            if (change) {
+                send_volume(take_change(pair, steps, change, 127));
+            }
+            break;
+
+        case TYPE_DIAL:
+            if (change) {
+                send_dial(take_change(pair, steps, change, DIAL_MAX));
+            }
+            break;
+
+        case TYPE_WHEEL:
+            if (change) {
+                send_wheel(take_change(pair, steps, change, 127), 0);
+            }
+            break;
+
+        case TYPE_PAN:
+            if (change) {
+                send_wheel(0, take_change(pair, steps, change, 127));
+            }
+            break;
+
+        default:
+            coalesceLimit(pair, COALESCE_KEY_BACKLOG);
+            send_step(reg);
+            break;
+    }
+}
+
+int main() {
+    ledInit();
     settingsInit();
     encInit();
+    encSetAccel(settingsGetAccel());
+    encSetDebounce(settingsGetTime(SETTINGS_TIME_DEBOUNCE));
+#if MATRIX_ENABLED
+    matrixInit();
+#endif
+#if ANALOG_ENABLED
+    analogInit();
+#endif
+    timerInit();
 
     // enable 1s watchdog timer
     wdt_enable(WDTO_1S); 
 
+    usbConfigure(settingsGetTime(SETTINGS_TIME_POLL));
     usbInit();
     
     // enforce re-enumeration
-    usbDeviceDisconnect(); 
-    for (i = 0; i < 250; i++) { 
-        // wait 500 ms
-        // keep the watchdog happy
-        wdt_reset(); 
-        _delay_ms(2);
-    }
-    usbDeviceConnect();
+    usbReconnect();
     
     // Enable interrupts after re-enumeration
     sei(); 
 
-    uint8_t last_btn_state = 0;
-    uint8_t last_enc_state = 0;
     uint8_t btn_state = 0;
-    uint8_t enc_state = 0;
+    uint8_t gesture;
+    uint8_t reg;
+    uint8_t pair;
+    uint8_t have_ev = 0;
+    uint8_t scroll_lock = 0;
+#if ANALOG_ENABLED
+    uint16_t fader;
+#endif
+    event_t ev;
 
     while (1) {
         // keep the watchdog happy
         wdt_reset(); 
-        encPoll();
         usbPoll();
+        usbReportTask();
+
+        // While Scroll Lock is on its profile overrides the one the host
+        // selected, which applies again once Scroll Lock is off
+        if ((keyboard_leds & KEYBOARD_LED_SCROLL) != scroll_lock) {
+            scroll_lock = keyboard_leds & KEYBOARD_LED_SCROLL;
+            settingsOverrideProfile(scroll_lock ? SETTINGS_PROFILE_SCROLL : SETTINGS_PROFILE_NONE);
+        }
+
+        // Settings written by the host apply right away, the EEPROM
+        // follows in the background
+        settingsTask();
+        if (settingsChanged()) {
+            encSetAccel(settingsGetAccel());
+            encSetDebounce(settingsGetTime(SETTINGS_TIME_DEBOUNCE));
+        }
+
+        // A new polling interval takes a new enumeration, not before the
+        // settings are saved so the host has seen the end of the transfer
+        if (!settingsSaving() && usbConfigure(settingsGetTime(SETTINGS_TIME_POLL))) {
+            usbReconnect();
+        }
 
-        btn_state = encGetButtonState();
-        enc_state = encGetState();
+        if (!have_ev) {
+            have_ev = eventPop(&ev);
+        }
+
+        // Rotation is always taken into the coalescing counts, anything
+        // else waits until its reports fit into their endpoint's queue
+        if (have_ev && event_fits(&ev)) {
+            have_ev = 0;
+
+            switch (ev.type) {
+                case EVENT_BTN_DOWN:
+                case EVENT_BTN_UP:
+                    // The button of a dial is sent as is, it selects no
+                    // layer and makes no gestures
+                    if (settingsGetType(SETTINGS_BTN) == TYPE_DIAL) {
+                        dial_button = (ev.type == EVENT_BTN_DOWN);
+                        send_dial(0);
+                        break;
+                    }
+
+                    btn_state = (ev.type == EVENT_BTN_DOWN);
+
+                    // A repeating tap action makes the button a plain held
+                    // key, there are no gestures then
+                    if (settingsGetRepeat(SETTINGS_BTN)) {
+                        gestureCancel();
+                        if (btn_state) {
+                            send_step(SETTINGS_BTN);
+                            repeatStart(SETTINGS_BTN, ev.time);
+                        } else {
+                            repeatStop(SETTINGS_BTN);
+                        }
+                        break;
+                    }
+
+                    gesture = gestureButton(btn_state, ev.time);
+                    if (gesture != GESTURE_NONE) {
+                        send_step(gesture);
+                    }
+                    break;
+
+                // While the button is held rotation uses the layer actions
+                // and the press does not count as a gesture any more.
+                // ev.arg is the number of steps after acceleration.
+                case EVENT_STEP_CW:
+                case EVENT_STEP_CCW:
+                    if (btn_state) {
+                        gestureCancel();
+                        repeatStop(SETTINGS_BTN);
+                    }
+
+                    coalesceAdd(COALESCE_PAIR(ev.index, btn_state), (ev.type == EVENT_STEP_CW) ? ev.arg : -ev.arg);
+                    break;
 
-        if (btn_state != last_btn_state) {
-            if (btn_state) {
-                // Pressed
-                send(settingsGetType(SETTINGS_BTN), settingsGetModifiers(SETTINGS_BTN), settingsGetKeycode(SETTINGS_BTN));
-            } else {
-                // Released
-                send(settingsGetType(SETTINGS_BTN), 0x00, 0x00);
+                // Matrix keys are held for as long as they are pressed,
+                // repeating keys are sent as taps instead
+                case EVENT_KEY_DOWN:
+                    reg = SETTINGS_KEY(ev.index);
+                    if (settingsGetRepeat(reg)) {
+                        send_step(reg);
+                        repeatStart(reg, ev.time);
+                    } else {
+                        press_key(ev.index);
+                    }
+                    break;
+
+                case EVENT_KEY_UP:
+                    repeatStop(SETTINGS_KEY(ev.index));
+                    release_key(ev.index);
+                    break;
             }
+        }
+
+        // Pending rotation, a pair that does not fit waits for its next
+        // turn while the others go on
+        pair = coalesceNext();
+        if (pair != COALESCE_NONE && action_fits(pair_reg(pair, 0)) && action_fits(pair_reg(pair, 1))) {
+            send_pair(pair);
+        }
 
-            last_btn_state = btn_state;
-        } else if (enc_state != last_enc_state && !btn_state) {
-            if (enc_state == SPIN_CW) {
-                send(settingsGetType(SETTINGS_CW), settingsGetModifiers(SETTINGS_CW), settingsGetKeycode(SETTINGS_CW));
-            } else if (enc_state == SPIN_CCW) {
-                send(settingsGetType(SETTINGS_CCW), settingsGetModifiers(SETTINGS_CCW), settingsGetKeycode(SETTINGS_CCW));
-            } else {
-                // No spin
-                if (last_enc_state == SPIN_CW) {
-                    send(settingsGetType(SETTINGS_CW), 0x00, 0x00);
-                } else if (last_enc_state == SPIN_CCW) {
-                    send(settingsGetType(SETTINGS_CCW), 0x00, 0x00);
-                }
-                
+        // Gestures that complete by timing out
+        if (action_fits(GESTURE_TAP) && action_fits(GESTURE_LONG) && action_fits(GESTURE_HOLD)) {
+            gesture = gesturePoll(timerNow());
+            if (gesture != GESTURE_NONE) {
+                send_step(gesture);
             }
+        }
+
+        // A repeat that does not fit is skipped, the rate stays the same
+        reg = repeatPoll(timerNow());
+        if (reg && action_fits(reg)) {
+            send_step(reg);
+        }
 
-            last_enc_state = enc_state;
+#if ANALOG_ENABLED
+        if (usbReportFree(REPID_FADER) && analogTake(&fader)) {
+            send_fader(fader);
         }
+#endif
     }
     
     return 0;
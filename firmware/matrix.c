@@ -0,0 +1,92 @@
+#include "matrix.h"
+#include "event.h"
+
+#if MATRIX_ENABLED
+
+#define sbi(port, bit) (port |= (1 << bit))
+#define cbi(port, bit) (port &= ~(1 << bit))
+
+/*
+ * Debounced key state and a 2-bit vertical counter per row. Bit n of each
+ * byte belongs to column n, so one row of keys is debounced with a few
+ * byte operations. A key flips after four consecutive samples that
+ * disagree with its debounced state.
+ */
+uint8_t matrix_state[MATRIX_ROWS];
+uint8_t matrix_ct0[MATRIX_ROWS];
+uint8_t matrix_ct1[MATRIX_ROWS];
+
+uint8_t matrix_row = 0; // Row that is currently driven low
+
+static void _matrixSelect(uint8_t row) {
+  // Idle rows float (input with pull-up) so pressed keys never short two rows
+  MATRIX_ROW_DDR &= ~MATRIX_ROW_MASK;
+  MATRIX_ROW_PORT |= MATRIX_ROW_MASK;
+
+  cbi(MATRIX_ROW_PORT, (MATRIX_ROW_SHIFT + row));
+  sbi(MATRIX_ROW_DDR, (MATRIX_ROW_SHIFT + row));
+}
+
+// Pressed keys of the selected row, column n in bit n
+static uint8_t _matrixReadColumns(void) {
+  uint8_t cols = PIND & MATRIX_COL_D_MASK;
+
+  if (PINB & (1 << PB1)) {
+    sbi(cols, 2);
+  }
+  if (PINB & (1 << PB5)) {
+    sbi(cols, 3);
+  }
+
+  return ~cols & ((1 << MATRIX_COLS) - 1);
+}
+
+void matrixInit(void) {
+  DDRD &= ~MATRIX_COL_D_MASK;
+  PORTD |= MATRIX_COL_D_MASK;
+  DDRB &= ~MATRIX_COL_B_MASK;
+  PORTB |= MATRIX_COL_B_MASK;
+
+  uint8_t row;
+  for (row = 0; row < MATRIX_ROWS; row++) {
+    matrix_ct0[row] = 0xFF;
+    matrix_ct1[row] = 0xFF;
+  }
+
+  _matrixSelect(matrix_row);
+}
+
+/*
+ * Called once per millisecond. Reads the row selected on the previous
+ * call, so the lines had a full tick to settle, then moves on to the
+ * next row.
+ */
+void matrixScan(void) {
+  uint8_t row = matrix_row;
+  uint8_t state = matrix_state[row];
+  uint8_t changed = state ^ _matrixReadColumns();
+  uint8_t ct0, ct1;
+
+  ct0 = ~(matrix_ct0[row] & changed);
+  ct1 = ct0 ^ (matrix_ct1[row] & changed);
+  changed &= ct0 & ct1;
+
+  matrix_ct0[row] = ct0;
+  matrix_ct1[row] = ct1;
+  matrix_state[row] = state ^ changed;
+
+  if (++matrix_row == MATRIX_ROWS) {
+    matrix_row = 0;
+  }
+  _matrixSelect(matrix_row);
+
+  // Only keys that flipped get here
+  uint8_t col;
+  for (col = 0; changed; col++, changed >>= 1) {
+    if (changed & 0x01) {
+      eventPush((state & (1 << col)) ? EVENT_KEY_UP : EVENT_KEY_DOWN, row * MATRIX_COLS + col, 0);
+    }
+  }
+}
+
+#endif // MATRIX_ENABLED
@@ -0,0 +1,32 @@
+#ifndef __MATRIX_H__
+#define __MATRIX_H__
+
+#include <avr/io.h>
+#include <stdint.h>
+
+/*
+ * 4x4 key matrix. Rows are driven low one at a time on PD4..PD7, the
+ * columns read back with pull-ups on PD0, PD1, PB1 and PB5. PD0/PD1 are
+ * the UART of the serial bootloader and PB5 is SCK, so the matrix is only
+ * scanned when built with "make MATRIX=1" on a board that has one.
+ */
+#ifndef MATRIX_ENABLED
+#define MATRIX_ENABLED  0
+#endif
+
+#define MATRIX_ROWS  4
+#define MATRIX_COLS  4
+#define MATRIX_KEYS  (MATRIX_ROWS * MATRIX_COLS)
+
+#define MATRIX_ROW_DDR   DDRD
+#define MATRIX_ROW_PORT  PORTD
+#define MATRIX_ROW_SHIFT PD4
+#define MATRIX_ROW_MASK  (((1 << MATRIX_ROWS) - 1) << MATRIX_ROW_SHIFT)
+
+#define MATRIX_COL_D_MASK  ((1 << PD0) | (1 << PD1))
+#define MATRIX_COL_B_MASK  ((1 << PB1) | (1 << PB5))
+
+void matrixInit(void);
+void matrixScan(void);
+
+#endif // __MATRIX_H__
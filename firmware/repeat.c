@@ -0,0 +1,67 @@
+#include "repeat.h"
+
+uint8_t repeat_reg[REPEAT_SLOTS];   // Repeating action slot, 0 if unused
+uint16_t repeat_due[REPEAT_SLOTS];  // Time of the next repeat
+
+// Short times would repeat on every pass of the main loop
+static uint16_t _repeatTime(uint8_t which) {
+  uint16_t ms = settingsGetTime(which);
+  return (ms < SETTINGS_TIME_MIN) ? SETTINGS_TIME_MIN : ms;
+}
+
+// The action has just been sent, it repeats after the delay
+void repeatStart(uint8_t reg, uint16_t now) {
+  uint8_t i;
+  uint8_t slot = REPEAT_SLOTS;
+
+  for (i = 0; i < REPEAT_SLOTS; i++) {
+    if (repeat_reg[i] == reg) {
+      slot = i;
+      break;
+    }
+
+    if (repeat_reg[i] == 0 && slot == REPEAT_SLOTS) {
+      slot = i;
+    }
+  }
+
+  // All slots busy, the action is sent once only
+  if (slot == REPEAT_SLOTS) {
+    return;
+  }
+
+  repeat_reg[slot] = reg;
+  repeat_due[slot] = now + _repeatTime(SETTINGS_TIME_REPEAT_DELAY);
+}
+
+void repeatStop(uint8_t reg) {
+  uint8_t i;
+
+  for (i = 0; i < REPEAT_SLOTS; i++) {
+    if (repeat_reg[i] == reg) {
+      repeat_reg[i] = 0;
+    }
+  }
+}
+
+// Returns the action slot that is due or 0. A late loop does not make up
+// for missed repeats, the rate stays fixed instead of bursting.
+uint8_t repeatPoll(uint16_t now) {
+  uint16_t rate = _repeatTime(SETTINGS_TIME_REPEAT_RATE);
+  uint8_t i;
+
+  for (i = 0; i < REPEAT_SLOTS; i++) {
+    if (repeat_reg[i] == 0 || (int16_t)(now - repeat_due[i]) < 0) {
+      continue;
+    }
+
+    repeat_due[i] += rate;
+    if ((int16_t)(now - repeat_due[i]) >= 0) {
+      repeat_due[i] = now + rate;
+    }
+
+    return repeat_reg[i];
+  }
+
+  return 0;
+}
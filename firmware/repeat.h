@@ -0,0 +1,19 @@
+#ifndef __REPEAT_H__
+#define __REPEAT_H__
+
+#include <stdint.h>
+
+#include "settings.h"
+
+/*
+ * Auto-repeat for held actions. Deadlines are kept against the Timer0
+ * millisecond clock, the main loop polls for the next due action.
+ * REPEAT_SLOTS actions can repeat at the same time.
+ */
+#define REPEAT_SLOTS  4
+
+void    repeatStart(uint8_t reg, uint16_t now);
+void    repeatStop(uint8_t reg);
+uint8_t repeatPoll(uint16_t now);
+
+#endif // __REPEAT_H__
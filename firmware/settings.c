@@ -1,42 +1,184 @@
 #include "settings.h"
 
 #include <avr/eeprom.h>
-
-#define NUM_REGISTERS 6
+#include <string.h>
 
 #define EEPROM_SIZE_ATMEGA328 1024  
 
 #define MAGIC_CODE  0x554B
-#define VERSION     0x0002
+#define VERSION     0x000B
 
 #define MASK_KEY      0x00FF
 #define MASK_MOD      0xFF00
 
+#define NUM_ACTIONS         (SETTINGS_LAST - SETTINGS_FIRST + 1)
+#define NUM_TYPE_REGISTERS  ((NUM_ACTIONS + 3) >> 2) // 4 bit type per action
+
 #define REGISTER_MAGIC    0x00
 #define REGISTER_VERSION  0x01
-#define REGISTER_CCW      0x02
-#define REGISTER_CW       0x03
-#define REGISTER_BTN      0x04
-#define REGISTER_TYPE     0x05
-
-uint8_t var_size;
-uint8_t buffer_len;
-uint8_t addr_status_buffer;
+#define REGISTER_TYPE     (SETTINGS_LAST + 1)
+#define REGISTER_ACCEL    (REGISTER_TYPE + NUM_TYPE_REGISTERS)
+#define REGISTER_TIME     (REGISTER_ACCEL + 1)
+#define REGISTER_PROFILE  (REGISTER_TIME + SETTINGS_TIMES) // Profile 1 and up
+
+#define NUM_PROFILE_REGISTERS  (NUM_ACTIONS + NUM_TYPE_REGISTERS)
+#define NUM_REGISTERS     (REGISTER_PROFILE + (SETTINGS_PROFILES - 1) * NUM_PROFILE_REGISTERS)
+
+#define IS_ACTION(reg)    ((reg) >= SETTINGS_FIRST && (reg) <= SETTINGS_LAST)
+
+#if NUM_REGISTERS != SETTINGS_REGISTERS
+#error "SETTINGS_REGISTERS does not match the register layout"
+#endif
+
+// record_size and save_pos are 8 bit and SAVE_IDLE is 0xFF
+#if (NUM_REGISTERS << 1) >= 0xFF
+#error "The settings record does not fit the saving state machine"
+#endif
+
+#define SAVE_IDLE         0xFF
+
+uint8_t var_size;    // Record plus its status byte
+uint8_t record_size; // All registers
+uint16_t buffer_len;
+uint16_t addr_status_buffer;
+
+/*
+ * Saving runs in the background, settingsTask() writes one byte whenever
+ * the EEPROM is ready. The status byte goes last, so a record only counts
+ * once it is complete. The record is written from a copy taken when the
+ * save starts, changes meanwhile go into the next record.
+ */
+uint8_t save_pos = SAVE_IDLE; // Next byte of the record, record_size for the status byte
+uint16_t save_index;          // Record being written
+uint8_t save_again = 0;       // Changed while saving, another record follows
+uint16_t save_record[NUM_REGISTERS];
+uint8_t settings_changed = 0;
+
+uint8_t settings_profile = 0;                        // Selected by the host
+uint8_t settings_override = SETTINGS_PROFILE_NONE;   // Takes precedence while set
 
 uint16_t settings[NUM_REGISTERS] = {
-  MAGIC_CODE,
-  VERSION,
-  0x00EA, // CCW, no modifiers, Volume Down
-  0x00E9, // CW, no modifiers, Volume Up
-  0x00E2, // BTN, no modifiers, Mute
-  0x0015, // CCW => MM, CW => MM, BTN => MM
-
-  // 0x0056, // CCW, no modifiers, Keypad -
-  // 0x0057, // CW, no modifiers, Keypad +
-  // 0x0055, // BTN, no modifiers, Keypad =
-  // 0x0000, // CCW => KB, CW => KB, BTN => KB
+  [REGISTER_MAGIC]   = MAGIC_CODE,
+  [REGISTER_VERSION] = VERSION,
+
+  [SETTINGS_KNOB_CCW(0)] = 0x00EA, // no modifiers, Volume Down
+  [SETTINGS_KNOB_CW(0)]  = 0x00E9, // no modifiers, Volume Up
+  [SETTINGS_KNOB_CCW(1)] = 0x00B6, // no modifiers, Previous Track
+  [SETTINGS_KNOB_CW(1)]  = 0x00B5, // no modifiers, Next Track
+  [SETTINGS_KNOB_CCW(2)] = 0x0050, // no modifiers, Left Arrow
+  [SETTINGS_KNOB_CW(2)]  = 0x004F, // no modifiers, Right Arrow
+  [SETTINGS_KNOB_CCW(3)] = 0x004E, // no modifiers, Page Down
+  [SETTINGS_KNOB_CW(3)]  = 0x004B, // no modifiers, Page Up
+  [SETTINGS_BTN]         = 0x00E2, // no modifiers, Mute
+  [SETTINGS_DTAP]        = 0x00CD, // no modifiers, Play/Pause
+  [SETTINGS_LONG]        = 0x00B7, // no modifiers, Stop
+  [SETTINGS_HOLD]        = 0x0000, // nothing
+
+  [SETTINGS_LAYER_KNOB_CCW(0)] = 0x00B6, // no modifiers, Previous Track
+  [SETTINGS_LAYER_KNOB_CW(0)]  = 0x00B5, // no modifiers, Next Track
+  [SETTINGS_LAYER_KNOB_CCW(1)] = 0x00EA, // no modifiers, Volume Down
+  [SETTINGS_LAYER_KNOB_CW(1)]  = 0x00E9, // no modifiers, Volume Up
+  [SETTINGS_LAYER_KNOB_CCW(2)] = 0x0051, // no modifiers, Down Arrow
+  [SETTINGS_LAYER_KNOB_CW(2)]  = 0x0052, // no modifiers, Up Arrow
+  [SETTINGS_LAYER_KNOB_CCW(3)] = 0x004D, // no modifiers, End
+  [SETTINGS_LAYER_KNOB_CW(3)]  = 0x004A, // no modifiers, Home
+
+  [SETTINGS_KEY(0)]  = 0x0068, // no modifiers, F13
+  [SETTINGS_KEY(1)]  = 0x0069, // no modifiers, F14
+  [SETTINGS_KEY(2)]  = 0x006A, // no modifiers, F15
+  [SETTINGS_KEY(3)]  = 0x006B, // no modifiers, F16
+  [SETTINGS_KEY(4)]  = 0x006C, // no modifiers, F17
+  [SETTINGS_KEY(5)]  = 0x006D, // no modifiers, F18
+  [SETTINGS_KEY(6)]  = 0x006E, // no modifiers, F19
+  [SETTINGS_KEY(7)]  = 0x006F, // no modifiers, F20
+  [SETTINGS_KEY(8)]  = 0x0070, // no modifiers, F21
+  [SETTINGS_KEY(9)]  = 0x0071, // no modifiers, F22
+  [SETTINGS_KEY(10)] = 0x0072, // no modifiers, F23
+  [SETTINGS_KEY(11)] = 0x0073, // no modifiers, F24
+  [SETTINGS_KEY(12)] = 0x0054, // no modifiers, Keypad /
+  [SETTINGS_KEY(13)] = 0x0055, // no modifiers, Keypad *
+  [SETTINGS_KEY(14)] = 0x0056, // no modifiers, Keypad -
+  [SETTINGS_KEY(15)] = 0x0057, // no modifiers, Keypad +
+
+  [REGISTER_TYPE]     = 0x1111, // Knob 0 and 1 => MM
+  [REGISTER_TYPE + 1] = 0x0000, // Knob 2 and 3 => KB
+  [REGISTER_TYPE + 2] = 0x0111, // BTN, DTAP, LONG => MM, HOLD => KB
+  [REGISTER_TYPE + 3] = 0x1111, // Layer knob 0 and 1 => MM
+  [REGISTER_TYPE + 4] = 0x0000, // Layer knob 2 and 3 => KB
+  [REGISTER_TYPE + 5] = 0x0000, // Keys 0 to 3 => KB
+  [REGISTER_TYPE + 6] = 0x0000, // Keys 4 to 7 => KB
+  [REGISTER_TYPE + 7] = 0x0000, // Keys 8 to 11 => KB
+  [REGISTER_TYPE + 8] = 0x8800, // Keys 12 to 15 => KB, keypad - and + repeat
+
+  [REGISTER_ACCEL] = 0x0002, // Medium acceleration curve
+
+  [REGISTER_TIME + SETTINGS_TIME_DTAP] = 250,
+  [REGISTER_TIME + SETTINGS_TIME_LONG] = 600,
+  [REGISTER_TIME + SETTINGS_TIME_HOLD] = 150,
+  [REGISTER_TIME + SETTINGS_TIME_DEBOUNCE] = 5,
+  [REGISTER_TIME + SETTINGS_TIME_REPEAT_DELAY] = 400,
+  [REGISTER_TIME + SETTINGS_TIME_REPEAT_RATE] = 50,
+  [REGISTER_TIME + SETTINGS_TIME_POLL] = 10,
+
+  // [SETTINGS_CCW]  = 0x0056, // no modifiers, Keypad -
+  // [SETTINGS_CW]   = 0x0057, // no modifiers, Keypad +
+  // [SETTINGS_BTN]  = 0x0055, // no modifiers, Keypad =
+  // [REGISTER_TYPE] = 0x0000, // CCW => KB, CW => KB, BTN => KB
 };
 
+// Action and type registers of a profile, indexed like settings[]
+static uint16_t *_settingsBank(uint8_t profile) {
+  return profile ? settings + REGISTER_PROFILE + (profile - 1) * NUM_PROFILE_REGISTERS - SETTINGS_FIRST : settings;
+}
+
+// The type nibble of an action slot holds the type and the repeat flag
+static uint8_t _settingsGetTypeBits(const uint16_t *bank, uint8_t reg) {
+  uint8_t slot = reg - SETTINGS_FIRST;
+  uint8_t shift = (slot & 0x03) << 2;
+
+  return (bank[REGISTER_TYPE + (slot >> 2)] >> shift) & 0x0F;
+}
+
+static void _settingsSetTypeBits(uint16_t *bank, uint8_t reg, uint8_t bits) {
+  uint8_t slot = reg - SETTINGS_FIRST;
+  uint8_t shift = (slot & 0x03) << 2;
+
+  bank[REGISTER_TYPE + (slot >> 2)] &= ~(0x0F << shift); // clear out old value
+  bank[REGISTER_TYPE + (slot >> 2)] |= (bits & 0x0F) << shift;
+}
+
+static void _settingsSetAction(uint16_t *bank, uint8_t reg, uint8_t type, uint8_t modifiers, uint8_t keycode) {
+  bank[reg] = (modifiers << 8) | keycode;
+  _settingsSetTypeBits(bank, reg, type);
+}
+
+// Times that are used as intervals must not be 0
+static uint16_t _settingsClampTime(uint8_t which, uint16_t ms) {
+  switch (which) {
+    case SETTINGS_TIME_DTAP:
+    case SETTINGS_TIME_LONG:
+    case SETTINGS_TIME_HOLD:
+    case SETTINGS_TIME_REPEAT_DELAY:
+    case SETTINGS_TIME_REPEAT_RATE:
+      return (ms < SETTINGS_TIME_MIN) ? SETTINGS_TIME_MIN : ms;
+  }
+
+  return ms;
+}
+
+// All actions of the bank have a known type
+static uint8_t _settingsValidTypes(const uint16_t *bank) {
+  uint8_t reg;
+
+  for (reg = SETTINGS_FIRST; reg <= SETTINGS_LAST; reg++) {
+    if ((_settingsGetTypeBits(bank, reg) & TYPE_MASK) > TYPE_LAST) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
 uint16_t _settingsFindNextWriteIndex() { 
   uint16_t i;
   for (i = addr_status_buffer; i < (buffer_len + addr_status_buffer); i++) {
@@ -62,12 +204,12 @@ uint16_t _settingsFindNextWriteIndex() {
 }
 
 void _settingsLoad() {
-  uint16_t write_offset = _settingsFindNextWriteIndex() * var_size;
+  uint16_t write_offset = _settingsFindNextWriteIndex() * record_size;
   uint16_t addr_read;
 
-  addr_read = write_offset - var_size;
+  addr_read = write_offset - record_size;
   if (write_offset == 0) {
-    addr_read = addr_status_buffer - var_size;
+    addr_read = (buffer_len - 1) * record_size;
   }
 
   uint16_t magic_code = eeprom_read_word((uint16_t*)addr_read);
@@ -82,15 +224,21 @@ void _settingsLoad() {
 }
 
 void _settingsSave() {
-  uint16_t write_offset = _settingsFindNextWriteIndex();
-  
-  uint8_t reg;
-  for (reg = 0; reg < NUM_REGISTERS; reg++) {
-    eeprom_update_word((uint16_t*)((write_offset * var_size) + (reg * sizeof(uint16_t))), settings[reg]);
+  settings_changed = 1;
+
+  if (save_pos != SAVE_IDLE) {
+    save_again = 1;
+    return;
   }
 
+  memcpy(save_record, settings, sizeof(save_record));
+  save_index = _settingsFindNextWriteIndex();
+  save_pos = 0;
+}
+
+void _settingsSaveStatus() {
   // Update status buffer 
-  uint16_t curr_index = addr_status_buffer + write_offset;
+  uint16_t curr_index = addr_status_buffer + save_index;
   uint16_t prev_index;
 
   // Wrap around case
@@ -104,32 +252,142 @@ void _settingsSave() {
   eeprom_update_byte((uint8_t*)curr_index, sb_val);
 }
 
+// Call from the main loop, it never waits for the EEPROM
+void settingsTask(void) {
+  if (save_pos == SAVE_IDLE || !eeprom_is_ready()) {
+    return;
+  }
+
+  if (save_pos < record_size) {
+    eeprom_update_byte((uint8_t*)(save_index * record_size + save_pos), ((uint8_t*)save_record)[save_pos]);
+    save_pos++;
+    return;
+  }
+
+  _settingsSaveStatus();
+  save_pos = SAVE_IDLE;
+
+  if (save_again) {
+    save_again = 0;
+    _settingsSave();
+  }
+}
+
+uint8_t settingsSaving(void) {
+  return save_pos != SAVE_IDLE;
+}
+
+// Returns 1 once after the settings changed
+uint8_t settingsChanged(void) {
+  uint8_t changed = settings_changed;
+  settings_changed = 0;
+  return changed;
+}
+
+// The whole block, SETTINGS_SIZE bytes, as stored in the EEPROM
+void settingsRead(uint8_t *data) {
+  memcpy(data, settings, SETTINGS_SIZE);
+}
+
+// Takes a whole block and saves it as one record. Blocks of another
+// layout (magic or version) or with unknown action types are rejected
+// with 0, times below their minimum are raised.
+uint8_t settingsWrite(const uint8_t *data) {
+  const uint16_t *block = (const uint16_t*)data;
+  uint8_t i;
+
+  if (block[REGISTER_MAGIC] != MAGIC_CODE || block[REGISTER_VERSION] != VERSION) {
+    return 0;
+  }
+
+  for (i = 0; i < SETTINGS_PROFILES; i++) {
+    if (!_settingsValidTypes(block + (_settingsBank(i) - settings))) {
+      return 0;
+    }
+  }
+
+  memcpy(settings, data, SETTINGS_SIZE);
+  for (i = 0; i < SETTINGS_TIMES; i++) {
+    settings[REGISTER_TIME + i] = _settingsClampTime(i, settings[REGISTER_TIME + i]);
+  }
+  _settingsSave();
+
+  return 1;
+}
+
 void settingsInit() {
-    var_size           = ((NUM_REGISTERS << 1) | 1);
+    record_size        = (NUM_REGISTERS << 1);
+    var_size           = record_size + 1;
     buffer_len         = (EEPROM_SIZE_ATMEGA328 / var_size);
     addr_status_buffer = EEPROM_SIZE_ATMEGA328 - buffer_len;
 
+    // The other profiles default to the actions of profile 0, the Scroll
+    // Lock profile scrolls with knob 0 and pans with knob 1
+    uint8_t i;
+    for (i = 1; i < SETTINGS_PROFILES; i++) {
+      memcpy(_settingsBank(i) + SETTINGS_FIRST, settings + SETTINGS_FIRST, NUM_PROFILE_REGISTERS << 1);
+    }
+
+    uint16_t *scroll = _settingsBank(SETTINGS_PROFILE_SCROLL);
+    _settingsSetAction(scroll, SETTINGS_KNOB_CCW(0), TYPE_WHEEL, 0, 8);          // one detent up
+    _settingsSetAction(scroll, SETTINGS_KNOB_CW(0),  TYPE_WHEEL, 0, (uint8_t)-8); // one detent down
+    _settingsSetAction(scroll, SETTINGS_KNOB_CCW(1), TYPE_PAN,   0, (uint8_t)-8); // one detent left
+    _settingsSetAction(scroll, SETTINGS_KNOB_CW(1),  TYPE_PAN,   0, 8);          // one detent right
+
     _settingsLoad();
 }
 
+static uint8_t _settingsProfile(void) {
+  return (settings_override != SETTINGS_PROFILE_NONE) ? settings_override : settings_profile;
+}
+
+// The profile the actions are read from
+uint8_t settingsGetProfile(void) {
+  return _settingsProfile();
+}
+
+void settingsSetProfile(uint8_t profile) {
+  uint8_t active = _settingsProfile();
+
+  if (profile >= SETTINGS_PROFILES) {
+    return;
+  }
+
+  settings_profile = profile;
+  settings_changed |= (_settingsProfile() != active);
+}
+
+// Uses the profile instead of the selected one until it is called with
+// SETTINGS_PROFILE_NONE, the selection stays as it is
+void settingsOverrideProfile(uint8_t profile) {
+  uint8_t active = _settingsProfile();
+
+  if (profile != SETTINGS_PROFILE_NONE && profile >= SETTINGS_PROFILES) {
+    return;
+  }
+
+  settings_override = profile;
+  settings_changed |= (_settingsProfile() != active);
+}
+
 uint8_t settingsGetKeycode(uint8_t reg) {
-  if (reg < SETTINGS_CCW || reg > SETTINGS_BTN) {
+  if (!IS_ACTION(reg)) {
     return 0;
   }
 
-  return settings[reg] & MASK_KEY;
+  return _settingsBank(_settingsProfile())[reg] & MASK_KEY;
 }
 
 uint8_t settingsGetModifiers(uint8_t reg) {
-  if (reg < SETTINGS_CCW || reg > SETTINGS_BTN) {
+  if (!IS_ACTION(reg)) {
     return 0;
   }
 
-  return (settings[reg] & MASK_MOD) >> 8;
+  return (_settingsBank(_settingsProfile())[reg] & MASK_MOD) >> 8;
 }
 
 void settingsSetKeycode(uint8_t reg, uint8_t keycode) {
-  if (reg < SETTINGS_CCW || reg > SETTINGS_BTN) {
+  if (!IS_ACTION(reg)) {
     return;
   }
 
@@ -140,7 +398,7 @@ void settingsSetKeycode(uint8_t reg, uint8_t keycode) {
 }
 
 void settingsSetModifiers(uint8_t reg, uint8_t modifiers) {
-  if (reg < SETTINGS_CCW || reg > SETTINGS_BTN) {
+  if (!IS_ACTION(reg)) {
     return;
   }
 
@@ -151,47 +409,73 @@ void settingsSetModifiers(uint8_t reg, uint8_t modifiers) {
 }
 
 uint8_t settingsGetType(uint8_t reg) {
-  if (reg < SETTINGS_CCW || reg > SETTINGS_BTN) {
+  if (!IS_ACTION(reg)) {
     return 0;
   }
 
-  uint16_t val = settings[REGISTER_TYPE];
+  return _settingsGetTypeBits(_settingsBank(_settingsProfile()), reg) & TYPE_MASK;
+}
 
-  if (reg == SETTINGS_CCW) {
-    val &= 0x03;
-    return val;
+void settingsSetType(uint8_t reg, uint8_t type) {
+  if (!IS_ACTION(reg) || type > TYPE_LAST) {
+    return;
   }
 
-  if (reg == SETTINGS_CW) {
-    val &= 0x0C;
-    return val >> 2;
+  _settingsSetTypeBits(settings, reg, (_settingsGetTypeBits(settings, reg) & TYPE_REPEAT) | (type & TYPE_MASK));
+}
+
+uint8_t settingsGetRepeat(uint8_t reg) {
+  if (!IS_ACTION(reg)) {
+    return 0;
   }
 
-  if (reg == SETTINGS_BTN) {
-    val &= 0x30;
-    return val >> 4;
+  return (_settingsGetTypeBits(_settingsBank(_settingsProfile()), reg) & TYPE_REPEAT) != 0;
+}
+
+// Sets an action of any profile, type includes the TYPE_REPEAT flag
+void settingsSetProfileAction(uint8_t profile, uint8_t reg, uint8_t type, uint8_t modifiers, uint8_t keycode) {
+  if (!IS_ACTION(reg) || profile >= SETTINGS_PROFILES || (type & TYPE_MASK) > TYPE_LAST) {
+    return;
   }
 
-  return 0;
+  _settingsSetAction(_settingsBank(profile), reg, type, modifiers, keycode);
+  _settingsSave();
 }
 
-void settingsSetType(uint8_t reg, uint8_t type) {
-  if (reg < SETTINGS_CCW || reg > SETTINGS_BTN) {
+void settingsSetRepeat(uint8_t reg, uint8_t repeat) {
+  if (!IS_ACTION(reg)) {
     return;
   }
 
-  if (reg == SETTINGS_CCW) {
-    settings[REGISTER_TYPE] &= 0x3C;
-    settings[REGISTER_TYPE] |= (type & 0x03);
-  } 
-  
-  if (reg == SETTINGS_CW) {
-    settings[REGISTER_TYPE] &= 0x33;
-    settings[REGISTER_TYPE] |= ((type & 0x03) << 2);
-  } 
+  _settingsSetTypeBits(settings, reg, (_settingsGetTypeBits(settings, reg) & TYPE_MASK) | (repeat ? TYPE_REPEAT : 0));
+
+  _settingsSave();
+}
+
+uint8_t settingsGetAccel() {
+  return settings[REGISTER_ACCEL] & 0xFF;
+}
+
+void settingsSetAccel(uint8_t curve) {
+  settings[REGISTER_ACCEL] = curve;
 
-  if (reg == SETTINGS_BTN) {
-    settings[REGISTER_TYPE] &= 0x0F;
-    settings[REGISTER_TYPE] |= ((type & 0x03) << 4);
+  _settingsSave();
+}
+
+uint16_t settingsGetTime(uint8_t which) {
+  if (which >= SETTINGS_TIMES) {
+    return 0;
   }
-}
\ No newline at end of file
+
+  return settings[REGISTER_TIME + which];
+}
+
+void settingsSetTime(uint8_t which, uint16_t ms) {
+  if (which >= SETTINGS_TIMES) {
+    return;
+  }
+
+  settings[REGISTER_TIME + which] = _settingsClampTime(which, ms);
+
+  _settingsSave();
+}
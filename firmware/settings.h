@@ -3,12 +3,63 @@
 
 #include <stdint.h>
 
-#define SETTINGS_CCW	0x02
-#define SETTINGS_CW 	0x03
-#define SETTINGS_BTN	0x04
+// Action slots, knob 0 is the main knob
+#define SETTINGS_KNOBS			4
+#define SETTINGS_KNOB_CCW(n)	(0x02 + ((n) << 1))
+#define SETTINGS_KNOB_CW(n) 	(0x03 + ((n) << 1))
+
+#define SETTINGS_CCW	SETTINGS_KNOB_CCW(0)
+#define SETTINGS_CW 	SETTINGS_KNOB_CW(0)
+#define SETTINGS_BTN	0x0A // Tap
+#define SETTINGS_DTAP	0x0B // Double tap
+#define SETTINGS_LONG	0x0C // Long press
+#define SETTINGS_HOLD	0x0D // Repeated while held after a long press
+
+// Layer action slots, used for rotation while the button is held
+#define SETTINGS_LAYER_KNOB_CCW(n)	(0x0E + ((n) << 1))
+#define SETTINGS_LAYER_KNOB_CW(n)	(0x0F + ((n) << 1))
+
+// Key matrix action slots
+#define SETTINGS_KEYS		16
+#define SETTINGS_KEY(n)		(0x16 + (n))
+
+#define SETTINGS_FIRST	SETTINGS_CCW
+#define SETTINGS_LAST	SETTINGS_KEY(SETTINGS_KEYS - 1)
+
+// Timings in ms
+#define SETTINGS_TIME_DTAP	0x00 // Max. gap between the taps of a double tap
+#define SETTINGS_TIME_LONG	0x01 // Min. duration of a long press
+#define SETTINGS_TIME_HOLD	0x02 // Hold repeat interval
+#define SETTINGS_TIME_DEBOUNCE	0x03 // Button debounce window
+#define SETTINGS_TIME_REPEAT_DELAY	0x04 // Auto-repeat delay after the press
+#define SETTINGS_TIME_REPEAT_RATE	0x05 // Auto-repeat interval
+#define SETTINGS_TIME_POLL	0x06 // USB polling interval, 0 for the default
+#define SETTINGS_TIMES		7
+#define SETTINGS_TIME_MIN	20 // Shortest hold and repeat interval
+
+// Profiles are sets of action and type registers, profile 0 is the one
+// the setters change. All of them are saved. Each one takes 90 bytes, a
+// third would not fit into one record (below 0xFF bytes), so the host has
+// one alternate profile and it is the Scroll Lock profile as well.
+#define SETTINGS_PROFILES	2
+#define SETTINGS_PROFILE_SCROLL	1 // Active while Scroll Lock is on
+#define SETTINGS_PROFILE_NONE	0xFF
+#define SETTINGS_PROFILE_REGISTERS	(SETTINGS_LAST - SETTINGS_FIRST + 1 + ((SETTINGS_LAST - SETTINGS_FIRST + 4) >> 2))
+
+// The whole block of 16 bit registers, including magic and version
+#define SETTINGS_REGISTERS	(SETTINGS_LAST + 1 + ((SETTINGS_LAST - SETTINGS_FIRST + 4) >> 2) + 1 + SETTINGS_TIMES \
+				 + (SETTINGS_PROFILES - 1) * SETTINGS_PROFILE_REGISTERS)
+#define SETTINGS_SIZE		(SETTINGS_REGISTERS << 1)
 
 #define TYPE_KEYBOARD	0x00
 #define TYPE_MM			0x01
+#define TYPE_VOLUME		0x02 // Relative Consumer Volume, keycode is the signed change per step
+#define TYPE_DIAL		0x03 // Radial controller, keycode is the signed change per step in 0.1 deg
+#define TYPE_WHEEL		0x04 // Mouse wheel, keycode is the signed change per step in high resolution units
+#define TYPE_PAN		0x05 // Horizontal mouse wheel, same units as TYPE_WHEEL
+#define TYPE_LAST		TYPE_PAN
+#define TYPE_MASK		0x07
+#define TYPE_REPEAT		0x08 // Flag, the action repeats while held
 
 // Multimedia Keys
 #define MMKEY_KB_VOL_UP			0x80 // do not use
@@ -36,6 +87,17 @@
 #define MMKEY_KB_MUTE			0x7F // do not use
 
 void settingsInit(void);
+void settingsTask(void);
+uint8_t settingsSaving(void);
+uint8_t settingsChanged(void);
+
+void    settingsRead(uint8_t *data);
+uint8_t settingsWrite(const uint8_t *data);
+
+uint8_t settingsGetProfile(void);
+void    settingsSetProfile(uint8_t profile);
+void    settingsOverrideProfile(uint8_t profile);
+void    settingsSetProfileAction(uint8_t profile, uint8_t reg, uint8_t type, uint8_t modifiers, uint8_t keycode);
 
 uint8_t settingsGetKeycode(uint8_t type);
 void    settingsSetKeycode(uint8_t type, uint8_t keycode);
@@ -46,4 +108,13 @@ void    settingsSetModifiers(uint8_t type, uint8_t modifiers);
 uint8_t settingsGetType(uint8_t reg);
 void 	settingsSetType(uint8_t reg, uint8_t type);
 
+uint8_t settingsGetRepeat(uint8_t reg);
+void    settingsSetRepeat(uint8_t reg, uint8_t repeat);
+
+uint8_t settingsGetAccel(void);
+void    settingsSetAccel(uint8_t curve);
+
+uint16_t settingsGetTime(uint8_t which);
+void     settingsSetTime(uint8_t which, uint16_t ms);
+
 #endif // __SETTINGS_H__
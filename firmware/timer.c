@@ -0,0 +1,55 @@
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+#include "timer.h"
+#include "encoder.h"
+#include "event.h"
+#include "led.h"
+#include "matrix.h"
+
+#if (F_CPU / TIMER_PRESCALER / TIMER_TICK_HZ) > 256
+#error "Timer0 cannot reach TIMER_TICK_HZ with this prescaler"
+#endif
+
+#define TICKS_PER_MS (TIMER_TICK_HZ / 1000)
+
+volatile uint16_t timer_ms = 0; // Milliseconds since timerInit(), wraps around
+
+void timerInit(void) {
+  TCCR0A = (1 << WGM01);               // CTC, TOP = OCR0A
+  TCCR0B = (1 << CS01) | (1 << CS00);  // F_CPU / 64
+  OCR0A  = (F_CPU / TIMER_PRESCALER / TIMER_TICK_HZ) - 1;
+  TIMSK0 |= (1 << OCIE0A);
+}
+
+// Non-blocking for the same reason as the encoder handler: INT0 comes first
+ISR(TIMER0_COMPA_vect, ISR_NOBLOCK) {
+  static uint8_t ticks;
+
+  EVENT_CAPTURE_BEGIN();
+
+#if ENC_SAMPLE_TIMER
+  encSample();
+#endif
+
+  if (++ticks == TICKS_PER_MS) {
+    ticks = 0;
+    timer_ms++;
+
+    encButtonSample();
+#if MATRIX_ENABLED
+    matrixScan();
+#endif
+    ledTick();
+  }
+
+  EVENT_CAPTURE_END();
+}
+
+uint16_t timerNow(void) {
+  uint16_t tmp;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    tmp = timer_ms;
+  }
+  return tmp;
+}
@@ -0,0 +1,17 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <avr/io.h>
+#include <stdint.h>
+
+/*
+ * Timer0 runs in CTC mode, the tick drives sampling and the millisecond
+ * clock. TIMER_TICK_HZ must be a multiple of 1000.
+ */
+#define TIMER_PRESCALER 64
+#define TIMER_TICK_HZ   2000
+
+void timerInit(void);
+uint16_t timerNow(void);
+
+#endif // __TIMER_H__
@@ -1,42 +1,26 @@
 #include <stdint.h>
-#include <util/delay.h>
+#include <string.h>
+#include <avr/pgmspace.h>
 #include <avr/wdt.h>
+#include <util/atomic.h>
+#include <util/delay.h>
 
+#include "analog.h"
+#include "coalesce.h"
+#include "encoder.h"
+#include "event.h"
+#include "led.h"
+#include "timer.h"
 #include "usb.h"
 #include "usbdrv.h"
 
-// USB HID report descriptor for boot protocol keyboard
-// see HID1_11.pdf appendix B section 1
-// USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH is defined in usbconfig (should be 173)
-const PROGMEM char usbHidReportDescriptor[USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH] = {
-	0x05, 0x01,           // USAGE_PAGE (Generic Desktop)
-	0x09, 0x02,           // USAGE (Mouse)
-	0xa1, 0x01,           // COLLECTION (Application)
-	0x09, 0x01,           //   USAGE (Pointer)
-	0xA1, 0x00,           //   COLLECTION (Physical)
-	0x85, REPID_MOUSE,    //     REPORT_ID
-	0x05, 0x09,           //     USAGE_PAGE (Button)
-	0x19, 0x01,           //     USAGE_MINIMUM
-	0x29, 0x03,           //     USAGE_MAXIMUM
-	0x15, 0x00,           //     LOGICAL_MINIMUM (0)
-	0x25, 0x01,           //     LOGICAL_MAXIMUM (1)
-	0x95, 0x03,           //     REPORT_COUNT (3)
-	0x75, 0x01,           //     REPORT_SIZE (1)
-	0x81, 0x02,           //     INPUT (Data,Var,Abs)
-	0x95, 0x01,           //     REPORT_COUNT (1)
-	0x75, 0x05,           //     REPORT_SIZE (5)
-	0x81, 0x03,           //     INPUT (Const,Var,Abs)
-	0x05, 0x01,           //     USAGE_PAGE (Generic Desktop)
-	0x09, 0x30,           //     USAGE (X)
-	0x09, 0x31,           //     USAGE (Y)
-	0x15, 0x81,           //     LOGICAL_MINIMUM (-127)
-	0x25, 0x7F,           //     LOGICAL_MAXIMUM (127)
-	0x75, 0x08,           //     REPORT_SIZE (8)
-	0x95, 0x02,           //     REPORT_COUNT (2)
-	0x81, 0x06,           //     INPUT (Data,Var,Rel)
-	0xC0,                 //   END_COLLECTION
-	0xC0,                 // END COLLECTION
+#if SETTINGS_SIZE > 255
+#error "The settings block does not fit into one feature report"
+#endif
 
+// USB HID report descriptor for boot protocol keyboard, interface 0
+// see HID1_11.pdf appendix B section 1
+const PROGMEM char usbHidReportDescriptorKeyboard[] = {
 	0x05, 0x01,           // USAGE_PAGE (Generic Desktop)
 	0x09, 0x06,           // USAGE (Keyboard)
 	0xA1, 0x01,           // COLLECTION (Application)
@@ -70,6 +54,73 @@ const PROGMEM char usbHidReportDescriptor[USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH]
 	0x2A, 0xA4, 0x00,     //   USAGE_MAXIMUM (Keyboard Application)(164)
 	0x81, 0x00,           //   INPUT (Data,Ary,Abs)
 	0xC0,                 // END_COLLECTION
+};
+
+// Everything else, interface 1
+const PROGMEM char usbHidReportDescriptorControls[] = {
+	0x05, 0x01,           // USAGE_PAGE (Generic Desktop)
+	0x09, 0x02,           // USAGE (Mouse)
+	0xa1, 0x01,           // COLLECTION (Application)
+	0x09, 0x01,           //   USAGE (Pointer)
+	0xA1, 0x00,           //   COLLECTION (Physical)
+	0x85, REPID_MOUSE,    //     REPORT_ID
+	0x05, 0x09,           //     USAGE_PAGE (Button)
+	0x19, 0x01,           //     USAGE_MINIMUM
+	0x29, 0x03,           //     USAGE_MAXIMUM
+	0x15, 0x00,           //     LOGICAL_MINIMUM (0)
+	0x25, 0x01,           //     LOGICAL_MAXIMUM (1)
+	0x95, 0x03,           //     REPORT_COUNT (3)
+	0x75, 0x01,           //     REPORT_SIZE (1)
+	0x81, 0x02,           //     INPUT (Data,Var,Abs)
+	0x95, 0x01,           //     REPORT_COUNT (1)
+	0x75, 0x05,           //     REPORT_SIZE (5)
+	0x81, 0x03,           //     INPUT (Const,Var,Abs)
+	0x05, 0x01,           //     USAGE_PAGE (Generic Desktop)
+	0x09, 0x30,           //     USAGE (X)
+	0x09, 0x31,           //     USAGE (Y)
+	0x15, 0x81,           //     LOGICAL_MINIMUM (-127)
+	0x25, 0x7F,           //     LOGICAL_MAXIMUM (127)
+	0x75, 0x08,           //     REPORT_SIZE (8)
+	0x95, 0x02,           //     REPORT_COUNT (2)
+	0x81, 0x06,           //     INPUT (Data,Var,Rel)
+	0xA1, 0x02,           //     COLLECTION (Logical)
+	0x09, 0x48,           //       USAGE (Resolution Multiplier)
+	0x15, 0x00,           //       LOGICAL_MINIMUM (0)
+	0x25, 0x01,           //       LOGICAL_MAXIMUM (1)
+	0x35, 0x01,           //       PHYSICAL_MINIMUM (1)
+	0x45, MOUSE_RES_MULTIPLIER, //   PHYSICAL_MAXIMUM
+	0x75, 0x02,           //       REPORT_SIZE (2)
+	0x95, 0x01,           //       REPORT_COUNT (1)
+	0xB1, 0x02,           //       FEATURE (Data,Var,Abs) ; Wheel multiplier
+	0x09, 0x38,           //       USAGE (Wheel)
+	0x15, 0x81,           //       LOGICAL_MINIMUM (-127)
+	0x25, 0x7F,           //       LOGICAL_MAXIMUM (127)
+	0x35, 0x00,           //       PHYSICAL_MINIMUM (0)
+	0x45, 0x00,           //       PHYSICAL_MAXIMUM (0)
+	0x75, 0x08,           //       REPORT_SIZE (8)
+	0x81, 0x06,           //       INPUT (Data,Var,Rel)
+	0xC0,                 //     END_COLLECTION
+	0xA1, 0x02,           //     COLLECTION (Logical)
+	0x09, 0x48,           //       USAGE (Resolution Multiplier)
+	0x15, 0x00,           //       LOGICAL_MINIMUM (0)
+	0x25, 0x01,           //       LOGICAL_MAXIMUM (1)
+	0x35, 0x01,           //       PHYSICAL_MINIMUM (1)
+	0x45, MOUSE_RES_MULTIPLIER, //   PHYSICAL_MAXIMUM
+	0x75, 0x02,           //       REPORT_SIZE (2)
+	0xB1, 0x02,           //       FEATURE (Data,Var,Abs) ; Pan multiplier
+	0x15, 0x81,           //       LOGICAL_MINIMUM (-127)
+	0x25, 0x7F,           //       LOGICAL_MAXIMUM (127)
+	0x35, 0x00,           //       PHYSICAL_MINIMUM (0)
+	0x45, 0x00,           //       PHYSICAL_MAXIMUM (0)
+	0x75, 0x08,           //       REPORT_SIZE (8)
+	0x05, 0x0C,           //       USAGE_PAGE (Consumer Devices)
+	0x0A, 0x38, 0x02,     //       USAGE (AC Pan)
+	0x81, 0x06,           //       INPUT (Data,Var,Rel)
+	0xC0,                 //     END_COLLECTION
+	0x75, 0x04,           //     REPORT_SIZE (4)
+	0xB1, 0x03,           //     FEATURE (Cnst,Var,Abs) ; Multiplier padding
+	0xC0,                 //   END_COLLECTION
+	0xC0,                 // END COLLECTION
 
 	// this second multimedia key report is what handles the multimedia keys
 	0x05, 0x0C,           // USAGE_PAGE (Consumer Devices)
@@ -101,59 +152,546 @@ const PROGMEM char usbHidReportDescriptor[USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH]
 	0x75, 0x06,             //   REPORT_SIZE (6)
 	0x81, 0x03,             //   INPUT (Cnst,Var,Abs)
 	0xC0,                   // END_COLLECTION
+
+#if ANALOG_ENABLED
+	// absolute volume from the fader, only sent when the position changes
+	0x05, 0x0C,           // USAGE_PAGE (Consumer Devices)
+	0x09, 0x01,           // USAGE (Consumer Control)
+	0xA1, 0x01,           // COLLECTION (Application)
+	0x85, REPID_FADER,    //   REPORT_ID
+	0x09, 0xE0,           //   USAGE (Volume)
+	0x15, 0x00,           //   LOGICAL_MINIMUM (0)
+	0x26, 0xFF, 0x03,     //   LOGICAL_MAXIMUM (1023)
+	0x95, 0x01,           //   REPORT_COUNT (1)
+	0x75, 0x10,           //   REPORT_SIZE (16)
+	0x81, 0x02,           //   INPUT (Data,Var,Abs)
+	0xC0,                 // END_COLLECTION
+#endif
+
+	// relative volume, one report carries the change of several detents
+	0x05, 0x0C,           // USAGE_PAGE (Consumer Devices)
+	0x09, 0x01,           // USAGE (Consumer Control)
+	0xA1, 0x01,           // COLLECTION (Application)
+	0x85, REPID_VOLUME,   //   REPORT_ID
+	0x09, 0xE0,           //   USAGE (Volume)
+	0x15, 0x81,           //   LOGICAL_MINIMUM (-127)
+	0x25, 0x7F,           //   LOGICAL_MAXIMUM (127)
+	0x95, 0x01,           //   REPORT_COUNT (1)
+	0x75, 0x08,           //   REPORT_SIZE (8)
+	0x81, 0x06,           //   INPUT (Data,Var,Rel)
+	0xC0,                 // END_COLLECTION
+
+	// vendor defined configuration channel, the whole settings block
+	0x06, 0x00, 0xFF,     // USAGE_PAGE (Vendor Defined 0xFF00)
+	0x09, 0x01,           // USAGE (Vendor Usage 1)
+	0xA1, 0x01,           // COLLECTION (Application)
+	0x85, REPID_CONFIG,   //   REPORT_ID
+	0x09, 0x02,           //   USAGE (Vendor Usage 2)
+	0x15, 0x00,           //   LOGICAL_MINIMUM (0)
+	0x26, 0xFF, 0x00,     //   LOGICAL_MAXIMUM (255)
+	0x75, 0x08,           //   REPORT_SIZE (8)
+	0x95, SETTINGS_SIZE,  //   REPORT_COUNT
+	0xB1, 0x02,           //   FEATURE (Data,Var,Abs)
+	0x85, REPID_COMMAND,  //   REPORT_ID
+	0x09, 0x03,           //   USAGE (Vendor Usage 3)
+	0x95, REPSIZE_COMMAND - 1, // REPORT_COUNT
+	0x91, 0x02,           //   OUTPUT (Data,Var,Abs)
+	0x85, REPID_STATS,    //   REPORT_ID
+	0x09, 0x04,           //   USAGE (Vendor Usage 4)
+	0x95, REPSIZE_STATS - 1, //  REPORT_COUNT
+	0xB1, 0x03,           //   FEATURE (Cnst,Var,Abs)
+	0xC0,                 // END_COLLECTION
+
+	// radial controller, the button and the rotation in 0.1 deg
+	0x05, 0x01,           // USAGE_PAGE (Generic Desktop)
+	0x09, 0x0E,           // USAGE (System Multi-Axis Controller)
+	0xA1, 0x01,           // COLLECTION (Application)
+	0x85, REPID_DIAL,     //   REPORT_ID
+	0x05, 0x0D,           //   USAGE_PAGE (Digitizers)
+	0x09, 0x21,           //   USAGE (Puck)
+	0xA1, 0x00,           //   COLLECTION (Physical)
+	0x05, 0x09,           //     USAGE_PAGE (Button)
+	0x09, 0x01,           //     USAGE (Button 1)
+	0x15, 0x00,           //     LOGICAL_MINIMUM (0)
+	0x25, 0x01,           //     LOGICAL_MAXIMUM (1)
+	0x95, 0x01,           //     REPORT_COUNT (1)
+	0x75, 0x01,           //     REPORT_SIZE (1)
+	0x81, 0x02,           //     INPUT (Data,Var,Abs)
+	0x05, 0x01,           //     USAGE_PAGE (Generic Desktop)
+	0x09, 0x37,           //     USAGE (Dial)
+	0x55, 0x0F,           //     UNIT_EXPONENT (-1)
+	0x65, 0x14,           //     UNIT (Degrees)
+	0x36, 0xF0, 0xF1,     //     PHYSICAL_MINIMUM (-3600)
+	0x46, 0x10, 0x0E,     //     PHYSICAL_MAXIMUM (3600)
+	0x16, 0xF0, 0xF1,     //     LOGICAL_MINIMUM (-3600)
+	0x26, 0x10, 0x0E,     //     LOGICAL_MAXIMUM (3600)
+	0x75, 0x0F,           //     REPORT_SIZE (15)
+	0x81, 0x06,           //     INPUT (Data,Var,Rel)
+	0x55, 0x00,           //     UNIT_EXPONENT (0)
+	0x65, 0x00,           //     UNIT (None)
+	0x35, 0x00,           //     PHYSICAL_MINIMUM (0)
+	0x45, 0x00,           //     PHYSICAL_MAXIMUM (0)
+	0xC0,                 //   END_COLLECTION
+	0xC0,                 // END_COLLECTION
+};
+
+// Keyboard reports go through interface 0 and endpoint 1, all others
+// through interface 1 and endpoint 3, so they never queue behind each
+// other. Host commands come in on interface 1's interrupt-out endpoint.
+// Each interface has its own HID and report descriptor.
+// usbConfigure() copies this to RAM and fills in the polling interval.
+const PROGMEM char usbConfigurationTemplate[USB_CONFIGURATION_LENGTH] = {
+	9,                    // bLength
+	USBDESCR_CONFIG,      // bDescriptorType
+	USB_CONFIGURATION_LENGTH, 0, // wTotalLength
+	2,                    // bNumInterfaces
+	1,                    // bConfigurationValue
+	0,                    // iConfiguration
+	(1 << 7),             // bmAttributes (bus powered)
+	USB_CFG_MAX_BUS_POWER / 2, // bMaxPower in 2 mA units
+
+	9,                    // bLength
+	USBDESCR_INTERFACE,   // bDescriptorType
+	USB_IFACE_KEYBOARD,   // bInterfaceNumber
+	0,                    // bAlternateSetting
+	1,                    // bNumEndpoints
+	USB_CFG_INTERFACE_CLASS,
+	USB_CFG_INTERFACE_SUBCLASS,
+	USB_CFG_INTERFACE_PROTOCOL,
+	0,                    // iInterface
+
+	9,                    // bLength
+	USBDESCR_HID,         // bDescriptorType
+	0x01, 0x01,           // bcdHID
+	0x00,                 // bCountryCode
+	0x01,                 // bNumDescriptors
+	0x22,                 // bDescriptorType (Report)
+	sizeof(usbHidReportDescriptorKeyboard) & 0xFF, sizeof(usbHidReportDescriptorKeyboard) >> 8,
+
+	7,                    // bLength
+	USBDESCR_ENDPOINT,    // bDescriptorType
+	(char)0x81,           // bEndpointAddress (IN 1)
+	0x03,                 // bmAttributes (Interrupt)
+	8, 0,                 // wMaxPacketSize
+	0,                    // bInterval, see usbConfigure()
+
+	9,                    // bLength
+	USBDESCR_INTERFACE,   // bDescriptorType
+	USB_IFACE_CONTROLS,   // bInterfaceNumber
+	0,                    // bAlternateSetting
+	2,                    // bNumEndpoints
+	0x03,                 // bInterfaceClass (HID)
+	0x00,                 // bInterfaceSubClass
+	0x00,                 // bInterfaceProtocol
+	0,                    // iInterface
+
+	9,                    // bLength
+	USBDESCR_HID,         // bDescriptorType
+	0x01, 0x01,           // bcdHID
+	0x00,                 // bCountryCode
+	0x01,                 // bNumDescriptors
+	0x22,                 // bDescriptorType (Report)
+	sizeof(usbHidReportDescriptorControls) & 0xFF, sizeof(usbHidReportDescriptorControls) >> 8,
+
+	7,                    // bLength
+	USBDESCR_ENDPOINT,    // bDescriptorType
+	(char)(0x80 | USB_CFG_EP3_NUMBER), // bEndpointAddress (IN 3)
+	0x03,                 // bmAttributes (Interrupt)
+	8, 0,                 // wMaxPacketSize
+	0,                    // bInterval, see usbConfigure()
+
+	7,                    // bLength
+	USBDESCR_ENDPOINT,    // bDescriptorType
+	USB_EPOUT_NUMBER,     // bEndpointAddress (OUT 1)
+	0x03,                 // bmAttributes (Interrupt)
+	8, 0,                 // wMaxPacketSize
+	0,                    // bInterval, see usbConfigure()
 };
 
-uint8_t report_buffer[8];
+char usbDescriptorConfiguration[USB_CONFIGURATION_LENGTH];
+uint8_t usb_poll_interval = 0; // bInterval of all endpoints, 0 before usbConfigure()
+
+uint8_t report_buffer[8]; // Reports are assembled here for usbReportSend()
 uint8_t usb_connected = 0;
-uint8_t idle_rate = 500 / 4;
-uint8_t protocol_version = 0;
+uint8_t protocol_version = USB_PROTOCOL_REPORT;
+uint8_t mouse_resolution = 0; // Low resolution until the host enables it
+uint8_t keyboard_leds = 0;    // Lock state the host keeps for all keyboards
+uint8_t write_report_id = 0;  // Report that usbFunctionWrite() receives
+uint8_t control_buffer[8];    // Reports returned by GET_REPORT
 
-void usbReportSend(uint8_t sz) {
-	while (1) {
-		wdt_reset();
-		usbPoll();
-		if (usbInterruptIsReady()) {
-			usbSetInterrupt((uchar*)report_buffer, sz);
+// The configuration feature report is staged here in both directions, so
+// the transfer works on a consistent copy of the settings. The statistics
+// feature report is read out through here as well.
+uint8_t config_buffer[REPSIZE_CONFIG];
+uint8_t config_pos;
+uint8_t config_len;
 
-			// Toggle LED
-			PORTB |= (1 << PB0);
-      		_delay_ms(10);
-      		PORTB &= ~(1 << PB0);
+typedef struct {
+	uint8_t data[USB_QUEUE_SIZE][8];
+	uint8_t len[USB_QUEUE_SIZE];
+	uint8_t head; // Free running, head - tail is the fill level
+	uint8_t tail;
+} report_queue_t;
+
+report_queue_t queue_keyboard; // Endpoint 1
+report_queue_t queue_controls; // Endpoint 3
+
+/*
+ * Report state. The last report of every ID is kept with its relative
+ * fields cleared. It is what GET_REPORT returns, unchanged absolute reports
+ * are not sent again. While an ID's idle rate is set its state is repeated
+ * once the rate elapsed without a report, with idle rate 0 only changes are
+ * sent.
+ */
+uint8_t report_state[REPID_COUNT + 1][8];  // Byte 0 is 0 until the first report
+uint8_t report_state_len[REPID_COUNT + 1];
+uint8_t idle_rates[REPID_COUNT + 1];       // In 4 ms units
+uint16_t idle_due[REPID_COUNT + 1];        // timerNow() of the next idle report
+uint8_t report_resend = 0;                 // Bit per ID the host asked for again
+
+static uint8_t _usbQueueFree(report_queue_t *queue) {
+	return USB_QUEUE_SIZE - (uint8_t)(queue->head - queue->tail);
+}
 
+static uint8_t _usbIsRelative(uint8_t id) {
+	return id == REPID_MOUSE || id == REPID_VOLUME || id == REPID_DIAL;
+}
+
+static uint8_t _usbInterface(uint8_t id) {
+	return (id == REPID_KEYBOARD) ? USB_IFACE_KEYBOARD : USB_IFACE_CONTROLS;
+}
+
+static report_queue_t *_usbQueue(uint8_t id) {
+	return (id == REPID_KEYBOARD) ? &queue_keyboard : &queue_controls;
+}
+
+static void _usbIdleReset(void) {
+	uint8_t id;
+
+	for (id = 1; id <= REPID_COUNT; id++) {
+		report_state[id][0] = 0;
+		idle_rates[id] = 0;
+	}
+
+	// HID default for keyboards, infinite for everything else
+	idle_rates[REPID_KEYBOARD] = 500 / 4;
+}
+
+static void _usbSetIdle(uint8_t iface, uint8_t id, uint8_t rate) {
+	uint8_t i;
+
+	for (i = 1; i <= REPID_COUNT; i++) {
+		if (id ? i == id : _usbInterface(i) == iface) {
+			idle_rates[i] = rate;
+			idle_due[i] = timerNow() + (rate << 2);
+		}
+	}
+}
+
+// Repeats the first report of the interface that the host asked for again
+// or whose idle period elapsed
+static uint8_t *_usbIdleReport(uint8_t iface, uint8_t *len) {
+	uint16_t now = timerNow();
+	uint8_t id;
+
+	for (id = 1; id <= REPID_COUNT; id++) {
+		if (!report_state[id][0] || _usbInterface(id) != iface) {
+			continue;
+		}
+
+		if (report_resend & (1 << id)) {
+			report_resend &= ~(1 << id);
+			*len = report_state_len[id];
+			return report_state[id];
+		}
+
+		if (idle_rates[id] && (int16_t)(now - idle_due[id]) >= 0) {
+			idle_due[id] = now + (idle_rates[id] << 2);
+			*len = report_state_len[id];
+			return report_state[id];
+		}
+	}
+
+	return 0;
+}
+
+static uint8_t *_usbPut16(uint8_t *p, uint16_t value) {
+	*p++ = value & 0xFF;
+	*p++ = value >> 8;
+	return p;
+}
+
+// The counters of the input path, little endian. The ISRs update them, so
+// they are copied with interrupts off.
+static void _usbReadStats(uint8_t *report) {
+	uint8_t *p = report;
+
+	*p++ = REPID_STATS;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		p = _usbPut16(p, enc_glitches);
+		p = _usbPut16(p, enc_filtered);
+		p = _usbPut16(p, enc_bounces);
+		p = _usbPut16(p, coalesce_cancelled);
+		*p++ = event_overflows;
+		*p++ = event_high_water;
+	}
+}
+
+// A keyboard report in boot protocol layout, no ID and 6 keys
+static void _usbSendBoot(uint8_t *report) {
+	uint8_t boot[REPSIZE_BOOT];
+
+	memcpy(boot, report + 1, REPSIZE_KEYBOARD - 1);
+	boot[REPSIZE_BOOT - 1] = 0;
+	usbSetInterrupt((uchar*)boot, REPSIZE_BOOT);
+}
+
+static void _usbSendKeyboard(uint8_t *report, uint8_t len) {
+	if (protocol_version == USB_PROTOCOL_BOOT) {
+		_usbSendBoot(report);
+	} else {
+		usbSetInterrupt((uchar*)report, len);
+	}
+}
+
+// Queues the report in report_buffer, returns 0 if the queue is full
+uint8_t usbReportSend(uint8_t sz) {
+	uint8_t id = report_buffer[0];
+	report_queue_t *queue = _usbQueue(id);
+	uint8_t *state = report_state[id];
+
+	if (id == 0 || id > REPID_COUNT) {
+		return 0;
+	}
+
+	// A boot protocol host (BIOS) only reads the keyboard
+	if (protocol_version == USB_PROTOCOL_BOOT && id != REPID_KEYBOARD) {
+		return 1;
+	}
+
+	// Nothing changed, so there is nothing to tell the host
+	if (!_usbIsRelative(id) && state[0] && !memcmp(state, report_buffer, sz)) {
+		return 1;
+	}
+
+	if (!_usbQueueFree(queue)) {
+		return 0;
+	}
+
+	uint8_t slot = queue->head & (USB_QUEUE_SIZE - 1);
+	memcpy(queue->data[slot], report_buffer, sz);
+	queue->len[slot] = sz;
+	queue->head++;
+
+	memcpy(state, report_buffer, sz);
+	report_state_len[id] = sz;
+	idle_due[id] = timerNow() + (idle_rates[id] << 2);
+
+	// Repeating a movement would move again
+	switch (id) {
+		case REPID_MOUSE:
+			state[2] = state[3] = state[4] = state[5] = 0;
+			break;
+
+		case REPID_VOLUME:
+			state[1] = 0;
+			break;
+
+		case REPID_DIAL:
+			state[1] &= 0x01; // Keep the button
+			state[2] = 0;
 			break;
+	}
+
+	return 1;
+}
+
+// Room in the queue of the report ID, a full queue of one endpoint does
+// not hold up the reports of the other
+uint8_t usbReportFree(uint8_t id) {
+	return _usbQueueFree(_usbQueue(id));
+}
+
+// Hands at most one report per endpoint to the driver, call after usbPoll().
+// Idle reports only go out while the endpoint's queue is empty.
+void usbReportTask(void) {
+	uint8_t slot;
+	uint8_t len;
+	uint8_t *idle;
+
+	if (usbInterruptIsReady()) {
+		if (queue_keyboard.head != queue_keyboard.tail) {
+			slot = queue_keyboard.tail & (USB_QUEUE_SIZE - 1);
+			_usbSendKeyboard(queue_keyboard.data[slot], queue_keyboard.len[slot]);
+			queue_keyboard.tail++;
+			ledPulse();
+		} else if ((idle = _usbIdleReport(USB_IFACE_KEYBOARD, &len))) {
+			_usbSendKeyboard(idle, len);
 		}
 	}
+
+	if (usbInterruptIsReady3()) {
+		if (queue_controls.head != queue_controls.tail) {
+			slot = queue_controls.tail & (USB_QUEUE_SIZE - 1);
+			usbSetInterrupt3((uchar*)queue_controls.data[slot], queue_controls.len[slot]);
+			queue_controls.tail++;
+			ledPulse();
+		} else if ((idle = _usbIdleReport(USB_IFACE_CONTROLS, &len))) {
+			usbSetInterrupt3((uchar*)idle, len);
+		}
+	}
+}
+
+// Builds the configuration descriptor for a polling interval in ms, 0 or
+// out of range selects USB_CFG_INTR_POLL_INTERVAL. Returns 1 if it changed,
+// the host only sees the new interval after usbReconnect().
+uint8_t usbConfigure(uint16_t ms) {
+	uint8_t interval = (ms == 0 || ms > 255) ? USB_CFG_INTR_POLL_INTERVAL : ms;
+
+	if (interval == usb_poll_interval) {
+		return 0;
+	}
+
+	memcpy_P(usbDescriptorConfiguration, usbConfigurationTemplate, USB_CONFIGURATION_LENGTH);
+	usbDescriptorConfiguration[USB_EP1_OFFSET_INTERVAL] = interval;
+	usbDescriptorConfiguration[USB_EP3_OFFSET_INTERVAL] = interval;
+	usbDescriptorConfiguration[USB_EPOUT_OFFSET_INTERVAL] = interval;
+	usb_poll_interval = interval;
+
+	return 1;
+}
+
+// Drops off the bus for 500 ms so the host enumerates the device again.
+// Pending reports are meant for the old configuration and are dropped.
+void usbReconnect(void) {
+	uint8_t i;
+
+	usb_connected = 0;
+	protocol_version = USB_PROTOCOL_REPORT;
+	report_resend = 0;
+	keyboard_leds = 0;
+	ledSet(0);
+	queue_keyboard.tail = queue_keyboard.head;
+	queue_controls.tail = queue_controls.head;
+	_usbIdleReset();
+
+	usbDeviceDisconnect();
+	for (i = 0; i < 250; i++) {
+		// keep the watchdog happy
+		wdt_reset();
+		_delay_ms(2);
+	}
+	usbDeviceConnect();
+}
+
+// The configuration descriptor is built in RAM, HID and report descriptors
+// depend on the interface in wIndex
+usbMsgLen_t usbFunctionDescriptor(usbRequest_t *rq) {
+	uint8_t keyboard = (rq->wIndex.bytes[0] == USB_IFACE_KEYBOARD);
+
+	switch (rq->wValue.bytes[1]) {
+		case USBDESCR_CONFIG:
+			usbMsgPtr = (usbMsgPtr_t)usbDescriptorConfiguration;
+			return USB_CONFIGURATION_LENGTH;
+
+		case USBDESCR_HID:
+			usbMsgPtr = (usbMsgPtr_t)(usbConfigurationTemplate + (keyboard ? USB_HID_OFFSET_KEYBOARD : USB_HID_OFFSET_CONTROLS));
+			return 9;
+
+		case USBDESCR_HID_REPORT:
+			if (keyboard) {
+				usbMsgPtr = (usbMsgPtr_t)usbHidReportDescriptorKeyboard;
+				return sizeof(usbHidReportDescriptorKeyboard);
+			}
+
+			usbMsgPtr = (usbMsgPtr_t)usbHidReportDescriptorControls;
+			return sizeof(usbHidReportDescriptorControls);
+	}
+
+	return 0;
 }
 
 usbMsgLen_t usbFunctionSetup(uint8_t data[8]) {
 	usb_connected = 1;
 	usbRequest_t *rq = (void *)data;
+	uint8_t id;
 
 	if ((rq->bmRequestType & USBRQ_TYPE_MASK) != USBRQ_TYPE_CLASS) {
 		return 0; // Ignore request if it's not a class specific request
 	}
 
 	switch (rq->bRequest) {
+		// Report ID 0 stands for all reports of the interface
 		case USBRQ_HID_GET_IDLE:
-			usbMsgPtr = (usbMsgPtr_t)&idle_rate;
+			id = rq->wValue.bytes[0];
+			if (id == 0) {
+				id = (rq->wIndex.bytes[0] == USB_IFACE_KEYBOARD) ? REPID_KEYBOARD : REPID_MOUSE;
+			}
+			if (id > REPID_COUNT) {
+				return 0;
+			}
+			usbMsgPtr = (usbMsgPtr_t)&idle_rates[id];
 			return 1;
 
 		case USBRQ_HID_SET_IDLE:
-			idle_rate = rq->wValue.bytes[1];
+			_usbSetIdle(rq->wIndex.bytes[0], rq->wValue.bytes[0], rq->wValue.bytes[1]);
 			return 0;
 
 		case USBRQ_HID_GET_PROTOCOL:
+			if (rq->wIndex.bytes[0] != USB_IFACE_KEYBOARD) {
+				return 0;
+			}
 			usbMsgPtr = (usbMsgPtr_t)&protocol_version;
 			return 1;
 
+		// The protocol is in the low byte of wValue. Keyboard reports are
+		// converted when they are sent, the other interface is not read by
+		// a boot protocol host, so its pending reports are dropped.
 		case USBRQ_HID_SET_PROTOCOL:
-			protocol_version = rq->wValue.bytes[1];
+			if (rq->wIndex.bytes[0] == USB_IFACE_KEYBOARD) {
+				protocol_version = rq->wValue.bytes[0] ? USB_PROTOCOL_REPORT : USB_PROTOCOL_BOOT;
+				if (protocol_version == USB_PROTOCOL_BOOT) {
+					queue_controls.tail = queue_controls.head;
+				}
+			}
 			return 0;
 
+		// Answered from a copy of the kept state, so neither a report being
+		// assembled in report_buffer nor the queues are touched
 		case USBRQ_HID_GET_REPORT:
-			usbMsgPtr = (usbMsgPtr_t)&report_buffer;
-			report_buffer[0] = rq->wValue.bytes[0];
-			report_buffer[1] = report_buffer[2] = report_buffer[3] = report_buffer[4] = report_buffer[5] = report_buffer[6] = report_buffer[7] = 0;
+			id = rq->wValue.bytes[0];
+			usbMsgPtr = (usbMsgPtr_t)&control_buffer;
+			memset(control_buffer, 0, sizeof(control_buffer));
+			control_buffer[0] = id;
+
+			if (rq->wValue.bytes[1] == REPTYPE_FEATURE) {
+				if (id == REPID_MOUSE) {
+					control_buffer[1] = mouse_resolution;
+					return REPSIZE_MOUSE_FEATURE;
+				}
+				if (id == REPID_CONFIG) {
+					config_buffer[0] = REPID_CONFIG;
+					settingsRead(config_buffer + 1);
+					config_pos = 0;
+					config_len = REPSIZE_CONFIG;
+					return USB_NO_MSG; // Data goes out in usbFunctionRead()
+				}
+				if (id == REPID_STATS) {
+					_usbReadStats(config_buffer);
+					config_pos = 0;
+					config_len = REPSIZE_STATS;
+					return USB_NO_MSG;
+				}
+				return 0;
+			}
+
+			if (rq->wIndex.bytes[0] == USB_IFACE_KEYBOARD && protocol_version == USB_PROTOCOL_BOOT) {
+				control_buffer[0] = 0;
+				if (report_state[REPID_KEYBOARD][0]) {
+					memcpy(control_buffer, report_state[REPID_KEYBOARD] + 1, REPSIZE_KEYBOARD - 1);
+				}
+				return REPSIZE_BOOT;
+			}
 
 			// Determine the return data length based on which report ID was requested
 			usbMsgLen_t ret_val = 8;
@@ -173,15 +711,127 @@ usbMsgLen_t usbFunctionSetup(uint8_t data[8]) {
 				case REPID_SYSCTRLKEY:
 					ret_val = REPSIZE_SYSCTRLKEY;
 					break;
+
+				case REPID_FADER:
+					ret_val = REPSIZE_FADER;
+					break;
+
+				case REPID_VOLUME:
+					ret_val = REPSIZE_VOLUME;
+					break;
+
+				case REPID_DIAL:
+					ret_val = REPSIZE_DIAL;
+					break;
+			}
+
+			if (id && id <= REPID_COUNT && report_state[id][0]) {
+				memcpy(control_buffer, report_state[id], report_state_len[id]);
 			}
 
 			return ret_val;
-			return 8; // default
 
 		case USBRQ_HID_SET_REPORT:
+			if (rq->wValue.bytes[1] == REPTYPE_OUTPUT && rq->wIndex.bytes[0] == USB_IFACE_KEYBOARD) {
+				write_report_id = REPID_KEYBOARD;
+				return USB_NO_MSG;
+			}
+			if (rq->wValue.bytes[1] == REPTYPE_FEATURE && rq->wValue.bytes[0] == REPID_MOUSE) {
+				write_report_id = REPID_MOUSE;
+				return USB_NO_MSG; // Data follows in usbFunctionWrite()
+			}
+			if (rq->wValue.bytes[1] == REPTYPE_FEATURE && rq->wValue.bytes[0] == REPID_CONFIG) {
+				write_report_id = REPID_CONFIG;
+				config_pos = 0;
+				config_len = (rq->wLength.word < REPSIZE_CONFIG) ? rq->wLength.word : REPSIZE_CONFIG;
+				return USB_NO_MSG;
+			}
 			return 0;
 
 		default:
 			return 0;
 	}
-}
\ No newline at end of file
+}
+
+// Returns 1 once all data of the transfer is received. The settings are
+// only taken once the whole block is there, input is served meanwhile.
+uchar usbFunctionWrite(uchar *data, uchar len) {
+	switch (write_report_id) {
+		// Without the report ID in boot protocol
+		case REPID_KEYBOARD:
+			if (len >= REPSIZE_KEYBOARD_LEDS && data[0] == REPID_KEYBOARD) {
+				keyboard_leds = data[1];
+			} else if (len == 1) {
+				keyboard_leds = data[0];
+			}
+			ledSet(keyboard_leds & KEYBOARD_LEDS_SHOWN);
+			break;
+
+		case REPID_MOUSE:
+			if (len >= REPSIZE_MOUSE_FEATURE) {
+				mouse_resolution = data[1];
+			}
+			break;
+
+		case REPID_CONFIG:
+			if (len > config_len - config_pos) {
+				len = config_len - config_pos;
+			}
+			memcpy(config_buffer + config_pos, data, len);
+			config_pos += len;
+
+			if (config_pos < config_len) {
+				return 0;
+			}
+
+			if (config_len == REPSIZE_CONFIG && config_buffer[0] == REPID_CONFIG) {
+				settingsWrite(config_buffer + 1);
+			}
+			break;
+	}
+
+	write_report_id = 0;
+	return 1; // All data received
+}
+
+uchar usbFunctionRead(uchar *data, uchar len) {
+	if (len > config_len - config_pos) {
+		len = config_len - config_pos;
+	}
+
+	memcpy(data, config_buffer + config_pos, len);
+	config_pos += len;
+
+	return len;
+}
+
+// Commands from the host, called from usbPoll(). Each one only changes
+// state the main loop and the timer tick pick up, so nothing waits here.
+void usbFunctionWriteOut(uchar *data, uchar len) {
+	if (usbRxToken != USB_EPOUT_NUMBER || len != REPSIZE_COMMAND || data[0] != REPID_COMMAND) {
+		return;
+	}
+
+	switch (data[1]) {
+		case CMD_PROFILE:
+			settingsSetProfile(data[2]);
+			break;
+
+		case CMD_LED:
+			ledPattern(data[2], data[3]);
+			break;
+
+		// Goes out with the idle reports, once the endpoint's queue is empty
+		case CMD_RESEND:
+			if (data[2] == 0) {
+				report_resend = 0xFF;
+			} else if (data[2] <= REPID_COUNT) {
+				report_resend |= 1 << data[2];
+			}
+			break;
+
+		case CMD_ACTION:
+			settingsSetProfileAction(data[2], data[3], data[4], data[5], data[6]);
+			break;
+	}
+}
@@ -1,21 +1,99 @@
 #ifndef __USB_H__
 #define __USB_H__
 
+#include "settings.h"
+
 #define REPID_MOUSE         1
 #define REPID_KEYBOARD      2
 #define REPID_MMKEY         3
 #define REPID_SYSCTRLKEY    4
+#define REPID_FADER         5
+#define REPID_VOLUME        6
+#define REPID_DIAL          7
+#define REPID_COUNT         7 // Input reports are 1 to REPID_COUNT
+#define REPID_CONFIG        8 // Feature report with the whole settings block
+#define REPID_COMMAND       9 // Output report on the interrupt-out endpoint
+#define REPID_STATS         10 // Feature report with the input path counters
 
-#define REPSIZE_MOUSE       4
+#define REPSIZE_MOUSE       6
 #define REPSIZE_KEYBOARD    8
 #define REPSIZE_MMKEY       3
 #define REPSIZE_SYSCTRLKEY  2
+#define REPSIZE_FADER       3
+#define REPSIZE_VOLUME      2
+#define REPSIZE_DIAL        3
+
+#define REPSIZE_MOUSE_FEATURE 2
+#define REPSIZE_CONFIG      (1 + SETTINGS_SIZE)
+#define REPSIZE_COMMAND     8
+#define REPSIZE_STATS       11 // ID, 16 bit glitches, filtered, bounces, cancelled, 8 bit overflows, high water
+#define REPSIZE_KEYBOARD_LEDS 2 // Output report of the keyboard, 1 in boot protocol
+
+// Bits of the keyboard LED output report
+#define KEYBOARD_LED_NUM    0x01
+#define KEYBOARD_LED_CAPS   0x02
+#define KEYBOARD_LED_SCROLL 0x04
+#define KEYBOARD_LEDS_SHOWN (KEYBOARD_LED_NUM | KEYBOARD_LED_CAPS | KEYBOARD_LED_SCROLL)
+
+/*
+ * Commands in byte 1 of the command report, arguments follow. There are
+ * only profiles 0 and 1, and profile 1 is also the Scroll Lock profile.
+ * While Scroll Lock is on it is used whatever CMD_PROFILE selected, the
+ * selection applies again once Scroll Lock is off.
+ */
+#define CMD_PROFILE         0x01 // profile, 0 or 1
+#define CMD_LED             0x02 // pattern, step in ms (0 keeps the step)
+#define CMD_RESEND          0x03 // report ID, 0 for all
+#define CMD_ACTION          0x04 // profile, register, type, modifiers, keycode, saved
+
+#define DIAL_MAX            3600 // Largest rotation of one report in 0.1 deg
+
+// GET_PROTOCOL / SET_PROTOCOL, only the keyboard interface has a boot protocol
+#define USB_PROTOCOL_BOOT   0
+#define USB_PROTOCOL_REPORT 1
+#define REPSIZE_BOOT        8 // Keyboard report without the ID and with 6 keys
+
+// HID report types, high byte of wValue in GET_REPORT / SET_REPORT
+#define REPTYPE_INPUT       1
+#define REPTYPE_OUTPUT      2
+#define REPTYPE_FEATURE     3
+
+// Resolution Multiplier feature of the mouse report, set by the host
+#define MOUSE_RES_MULTIPLIER  8    // Wheel units per detent when enabled
+#define MOUSE_RES_WHEEL       0x03
+#define MOUSE_RES_PAN         0x0C
+
+/*
+ * Interfaces, keyboard reports use endpoint 1, all others endpoint 3
+ */
+#define USB_IFACE_KEYBOARD  0
+#define USB_IFACE_CONTROLS  1
+
+#define USB_CONFIGURATION_LENGTH  (9 + 2 * (9 + 9 + 7) + 7)
+#define USB_HID_OFFSET_KEYBOARD   (9 + 9)
+#define USB_HID_OFFSET_CONTROLS   (9 + 9 + 9 + 7 + 9)
+#define USB_EP1_OFFSET_INTERVAL   (9 + 9 + 9 + 6)
+#define USB_EP3_OFFSET_INTERVAL   (USB_HID_OFFSET_CONTROLS + 9 + 6)
+#define USB_EPOUT_OFFSET_INTERVAL (USB_CONFIGURATION_LENGTH - 1)
+#define USB_EPOUT_NUMBER          1
+
+/*
+ * Pending interrupt-in reports per endpoint, must be a power of two
+ */
+#define USB_QUEUE_SIZE      8
 
 extern uint8_t report_buffer[8];
 extern uint8_t usb_connected;
-extern uint8_t idle_rate;
+extern uint8_t idle_rates[REPID_COUNT + 1];
 extern uint8_t protocol_version;
+extern uint8_t mouse_resolution;
+extern uint8_t keyboard_leds;
+extern uint8_t usb_poll_interval;
 
-void usbReportSend(uint8_t sz);
+uint8_t usbReportSend(uint8_t sz);
+uint8_t usbReportFree(uint8_t id);
+void usbReportTask(void);
+uint8_t usbConfigure(uint16_t ms);
+void usbReconnect(void);
 
 #endif // __USB_H__
\ No newline at end of file